@@ -0,0 +1,396 @@
+#include "ArrowWriter.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <algorithm>
+#include <optional>
+
+using namespace llvm;
+
+namespace loopfeatures {
+
+constexpr char ArrowMagic[6] = {'A', 'R', 'R', 'O', 'W', '1'};
+
+// Values from the Arrow flatbuffer schemas (Schema.fbs, Message.fbs).
+enum : int16_t { MetadataV5 = 4 };
+enum : uint8_t { HeaderSchema = 1, HeaderRecordBatch = 3 };
+enum : uint8_t { TypeInt = 2, TypeUtf8 = 5 };
+
+namespace {
+// Minimal front-to-back flatbuffer encoder. Every object is written before
+// the objects it refers to, so all offsets point forward as the format
+// requires; offset fields are reserved as slots and patched once the target
+// has been written. Vtables are placed directly in front of their table.
+class FlatBufferWriter {
+public:
+  struct Field {
+    unsigned Id;
+    unsigned Size; // 1, 2, 4 or 8 bytes; offsets are 4.
+    uint64_t Value;
+    bool IsOffset;
+  };
+
+  static Field scalar(unsigned Id, unsigned Size, uint64_t Value) {
+    return {Id, Size, Value, false};
+  }
+  static Field offset(unsigned Id) { return {Id, 4, 0, true}; }
+
+  FlatBufferWriter() { Buf.resize(4); } // Root table offset.
+
+  // Writes a table and returns its position. The slot of each offset field
+  // is added to Slots in the order the fields were given.
+  size_t table(ArrayRef<Field> Fields,
+               SmallVectorImpl<size_t> *Slots = nullptr) {
+    SmallVector<Field, 8> Sorted(Fields.begin(), Fields.end());
+    std::stable_sort(Sorted.begin(), Sorted.end(),
+                     [](const Field &A, const Field &B) {
+                       return A.Size > B.Size;
+                     });
+    unsigned NumSlots = 0;
+    SmallVector<uint16_t, 8> FieldOffsets;
+    uint32_t TableSize = 4;
+    for (const Field &F : Sorted) {
+      NumSlots = std::max(NumSlots, F.Id + 1);
+      TableSize = alignTo(TableSize, F.Size);
+      FieldOffsets.push_back(TableSize);
+      TableSize += F.Size;
+    }
+
+    size_t VTable = alignTo(Buf.size(), 2);
+    size_t VTableSize = 4 + 2 * NumSlots;
+    size_t Table = alignTo(VTable + VTableSize, 8);
+    Buf.resize(Table + TableSize);
+    put<uint16_t>(VTable, VTableSize);
+    put<uint16_t>(VTable + 2, TableSize);
+    put<int32_t>(Table, Table - VTable);
+
+    for (const Field &F : Fields) {
+      auto It = std::find_if(Sorted.begin(), Sorted.end(),
+                             [&](const Field &S) { return S.Id == F.Id; });
+      unsigned Idx = It - Sorted.begin();
+      size_t Pos = Table + FieldOffsets[Idx];
+      put<uint16_t>(VTable + 4 + 2 * F.Id, FieldOffsets[Idx]);
+      if (F.IsOffset) {
+        Slots->push_back(Pos);
+        continue;
+      }
+      switch (F.Size) {
+      case 1: put<uint8_t>(Pos, F.Value); break;
+      case 2: put<uint16_t>(Pos, F.Value); break;
+      case 4: put<uint32_t>(Pos, F.Value); break;
+      case 8: put<uint64_t>(Pos, F.Value); break;
+      }
+    }
+    return Table;
+  }
+
+  size_t string(StringRef S) {
+    size_t Pos = alignTo(Buf.size(), 4);
+    Buf.resize(Pos + 4);
+    put<uint32_t>(Pos, S.size());
+    Buf.append(S.begin(), S.end());
+    Buf.push_back('\0');
+    return Pos;
+  }
+
+  // Writes a vector of Count structs of ElemSize bytes, 8-byte aligned.
+  size_t structVector(const void *Data, size_t Count, size_t ElemSize) {
+    size_t Pos = alignTo(Buf.size() + 4, 8) - 4;
+    Buf.resize(Pos + 4);
+    put<uint32_t>(Pos, Count);
+    Buf.append(static_cast<const char *>(Data), Count * ElemSize);
+    return Pos;
+  }
+
+  // Writes a vector of Count offsets and returns the slot of each element.
+  size_t offsetVector(size_t Count, SmallVectorImpl<size_t> &Slots) {
+    size_t Pos = alignTo(Buf.size(), 4);
+    Buf.resize(Pos + 4 + 4 * Count);
+    put<uint32_t>(Pos, Count);
+    for (size_t I = 0; I < Count; ++I)
+      Slots.push_back(Pos + 4 + 4 * I);
+    return Pos;
+  }
+
+  void patch(size_t Slot, size_t Target) { put<uint32_t>(Slot, Target - Slot); }
+  void setRoot(size_t Table) { patch(0, Table); }
+
+  StringRef data() const { return Buf; }
+
+private:
+  template <typename T> void put(size_t Pos, T Value) {
+    support::endian::write<T, support::little, 1>(&Buf[Pos], Value);
+  }
+
+  std::string Buf;
+};
+} // namespace
+
+static void writeZeros(raw_ostream &OS, size_t Count) {
+  static const char Zeros[8] = {};
+  for (; Count > sizeof(Zeros); Count -= sizeof(Zeros))
+    OS.write(Zeros, sizeof(Zeros));
+  OS.write(Zeros, Count);
+}
+
+// Schema { fields: [Field] } with
+// Field { name, nullable, type_type, type, children }.
+static size_t writeSchema(FlatBufferWriter &FB, ArrayRef<ColumnDesc> Schema) {
+  using FBW = FlatBufferWriter;
+  SmallVector<size_t, 1> SchemaSlots;
+  size_t SchemaTable = FB.table({FBW::offset(1)}, &SchemaSlots);
+  SmallVector<size_t, 32> FieldSlots;
+  FB.patch(SchemaSlots[0], FB.offsetVector(Schema.size(), FieldSlots));
+
+  for (unsigned Col = 0; Col < Schema.size(); ++Col) {
+    ColumnType Type = Schema[Col].Type;
+    SmallVector<size_t, 3> Slots;
+    size_t Field = FB.table(
+        {FBW::offset(0), FBW::scalar(1, 1, 0),
+         FBW::scalar(2, 1, Type == ColumnType::String ? TypeUtf8 : TypeInt),
+         FBW::offset(3), FBW::offset(5)},
+        &Slots);
+    FB.patch(FieldSlots[Col], Field);
+    FB.patch(Slots[0], FB.string(Schema[Col].Name));
+    if (Type == ColumnType::String)
+      FB.patch(Slots[1], FB.table({}));
+    else
+      FB.patch(Slots[1],
+               FB.table({FBW::scalar(0, 4, Type == ColumnType::Int64 ? 64 : 32),
+                         FBW::scalar(1, 1, 1)}));
+    SmallVector<size_t, 0> NoChildren;
+    FB.patch(Slots[2], FB.offsetVector(0, NoChildren));
+  }
+  return SchemaTable;
+}
+
+// Message { version, header_type, header, bodyLength } whose header is
+// filled in by WriteHeader.
+template <typename HeaderWriter>
+static std::string encodeMessage(uint8_t HeaderType, int64_t BodyLength,
+                                 HeaderWriter WriteHeader) {
+  using FBW = FlatBufferWriter;
+  FlatBufferWriter FB;
+  SmallVector<size_t, 1> Slots;
+  FB.setRoot(FB.table({FBW::scalar(0, 2, MetadataV5),
+                       FBW::scalar(1, 1, HeaderType), FBW::offset(2),
+                       FBW::scalar(3, 8, BodyLength)},
+                      &Slots));
+  FB.patch(Slots[0], WriteHeader(FB));
+  return FB.data().str();
+}
+
+// Writes the continuation marker, metadata length and padded metadata of an
+// encapsulated message and returns the number of bytes written.
+static int32_t writeMessageMetadata(raw_ostream &OS, StringRef Metadata) {
+  support::endian::Writer W(OS, support::little);
+  size_t Padded = alignTo(Metadata.size() + 8, 8) - 8;
+  W.write<uint32_t>(0xFFFFFFFF);
+  W.write<int32_t>(Padded);
+  OS << Metadata;
+  writeZeros(OS, Padded - Metadata.size());
+  return 8 + Padded;
+}
+
+void writeArrowFileHeader(raw_ostream &OS, ArrayRef<ColumnDesc> Schema) {
+  OS.write(ArrowMagic, sizeof(ArrowMagic));
+  writeZeros(OS, 2);
+  writeMessageMetadata(
+      OS, encodeMessage(HeaderSchema, 0, [&](FlatBufferWriter &FB) {
+        return writeSchema(FB, Schema);
+      }));
+}
+
+void writeArrowStreamHeader(raw_ostream &OS, ArrayRef<ColumnDesc> Schema) {
+  writeMessageMetadata(
+      OS, encodeMessage(HeaderSchema, 0, [&](FlatBufferWriter &FB) {
+        return writeSchema(FB, Schema);
+      }));
+}
+
+// Writes Chunk as a record batch message at file offset Offset, after
+// padding to the 8-byte alignment messages need, and returns its block.
+static ArrowBlock writeRecordBatchMessage(raw_ostream &OS, uint64_t Offset,
+                                          const FeatureChunkBuilder &Chunk) {
+  ArrayRef<ColumnDesc> Schema = Chunk.getSchema();
+  size_t NumRows = Chunk.getNumRows();
+
+  // Body buffers plus the FieldNode and Buffer structs describing them.
+  std::string Body;
+  raw_string_ostream BodyOS(Body);
+  support::endian::Writer BodyW(BodyOS, support::little);
+  std::string Nodes, Buffers;
+  raw_string_ostream NodesOS(Nodes), BuffersOS(Buffers);
+  support::endian::Writer NodesW(NodesOS, support::little);
+  support::endian::Writer BuffersW(BuffersOS, support::little);
+  auto AddBuffer = [&](size_t Start) {
+    BuffersW.write<int64_t>(Start);
+    BuffersW.write<int64_t>(Body.size() - Start);
+    writeZeros(BodyOS, alignTo(Body.size(), 8) - Body.size());
+  };
+
+  for (unsigned Col = 0; Col < Schema.size(); ++Col) {
+    NodesW.write<int64_t>(NumRows);
+    NodesW.write<int64_t>(0);
+    AddBuffer(Body.size()); // No validity bitmap.
+    size_t Start = Body.size();
+    switch (Schema[Col].Type) {
+    case ColumnType::Int32:
+      BodyW.write(Chunk.getInt32Column(Col));
+      AddBuffer(Start);
+      break;
+    case ColumnType::Int64:
+      BodyW.write(Chunk.getInt64Column(Col));
+      AddBuffer(Start);
+      break;
+    case ColumnType::String: {
+      int32_t End = 0;
+      BodyW.write<int32_t>(End);
+      for (size_t Row = 0; Row < NumRows; ++Row)
+        BodyW.write<int32_t>(End += Chunk.getString(Col, Row).size());
+      AddBuffer(Start);
+      Start = Body.size();
+      for (size_t Row = 0; Row < NumRows; ++Row)
+        BodyOS << Chunk.getString(Col, Row);
+      AddBuffer(Start);
+      break;
+    }
+    }
+  }
+
+  // Messages must start 8-byte aligned; the previous footer may not end so.
+  writeZeros(OS, alignTo(Offset, 8) - Offset);
+  Offset = alignTo(Offset, 8);
+
+  // RecordBatch { length, nodes: [FieldNode], buffers: [Buffer] }
+  std::string Metadata = encodeMessage(
+      HeaderRecordBatch, Body.size(), [&](FlatBufferWriter &FB) {
+        using FBW = FlatBufferWriter;
+        SmallVector<size_t, 2> Slots;
+        size_t Batch = FB.table(
+            {FBW::scalar(0, 8, NumRows), FBW::offset(1), FBW::offset(2)},
+            &Slots);
+        FB.patch(Slots[0],
+                 FB.structVector(Nodes.data(), Nodes.size() / 16, 16));
+        FB.patch(Slots[1],
+                 FB.structVector(Buffers.data(), Buffers.size() / 16, 16));
+        return Batch;
+      });
+  int32_t MetaDataLength = writeMessageMetadata(OS, Metadata);
+  OS << Body;
+  return {static_cast<int64_t>(Offset), MetaDataLength,
+          static_cast<int64_t>(Body.size())};
+}
+
+void writeArrowStreamRecordBatch(raw_ostream &OS,
+                                 const FeatureChunkBuilder &Chunk) {
+  // Every message is a multiple of 8 bytes long, so the stream stays
+  // aligned without knowing its offset.
+  writeRecordBatchMessage(OS, 0, Chunk);
+}
+
+void writeArrowStreamEnd(raw_ostream &OS) {
+  support::endian::Writer W(OS, support::little);
+  W.write<uint32_t>(0xFFFFFFFF);
+  W.write<int32_t>(0);
+}
+
+void writeArrowRecordBatch(raw_ostream &OS, uint64_t Offset,
+                           const FeatureChunkBuilder &Chunk,
+                           std::vector<ArrowBlock> &Blocks) {
+  ArrayRef<ColumnDesc> Schema = Chunk.getSchema();
+  Blocks.push_back(writeRecordBatchMessage(OS, Offset, Chunk));
+
+  // Footer { version, schema, dictionaries: [Block], recordBatches: [Block] }
+  std::string BlockData;
+  raw_string_ostream BlockOS(BlockData);
+  support::endian::Writer BlockW(BlockOS, support::little);
+  for (const ArrowBlock &B : Blocks) {
+    BlockW.write<int64_t>(B.Offset);
+    BlockW.write<int32_t>(B.MetaDataLength);
+    BlockW.write<int32_t>(0);
+    BlockW.write<int64_t>(B.BodyLength);
+  }
+  using FBW = FlatBufferWriter;
+  FlatBufferWriter FB;
+  SmallVector<size_t, 3> Slots;
+  FB.setRoot(FB.table({FBW::scalar(0, 2, MetadataV5), FBW::offset(1),
+                       FBW::offset(2), FBW::offset(3)},
+                      &Slots));
+  FB.patch(Slots[0], writeSchema(FB, Schema));
+  FB.patch(Slots[1], FB.structVector(nullptr, 0, 24));
+  FB.patch(Slots[2], FB.structVector(BlockData.data(), Blocks.size(), 24));
+  OS << FB.data();
+  support::endian::Writer(OS, support::little).write<int32_t>(FB.data().size());
+  OS.write(ArrowMagic, sizeof(ArrowMagic));
+}
+
+std::optional<uint64_t> getArrowFooterOffset(const MemoryBuffer &Buffer) {
+  StringRef Data = Buffer.getBuffer();
+  if (Data.size() < 8 + 10 || !Data.endswith(StringRef(ArrowMagic, 6)))
+    return std::nullopt;
+  uint32_t FooterSize = support::endian::read32le(Data.end() - 10);
+  if (FooterSize > Data.size() - 18)
+    return std::nullopt;
+  return Data.size() - 10 - FooterSize;
+}
+
+Expected<std::vector<ArrowBlock>>
+readArrowRecordBatchBlocks(const MemoryBuffer &Buffer) {
+  StringRef Path = Buffer.getBufferIdentifier();
+  StringRef Data = Buffer.getBuffer();
+  std::vector<ArrowBlock> Blocks;
+  if (Data.size() < 8 + 10 || !Data.endswith(StringRef(ArrowMagic, 6)))
+    return Blocks;
+
+  auto Malformed = [&] {
+    return createFileError(Path, createStringError(inconvertibleErrorCode(),
+                                                   "malformed Arrow footer"));
+  };
+  using namespace support;
+  uint32_t FooterSize = endian::read32le(Data.end() - 10);
+  if (FooterSize > Data.size() - 18)
+    return Malformed();
+  StringRef Footer(Data.end() - 10 - FooterSize, FooterSize);
+  auto Read32 = [&](size_t Pos) -> std::optional<uint32_t> {
+    if (Pos + 4 > Footer.size())
+      return std::nullopt;
+    return endian::read32le(Footer.data() + Pos);
+  };
+
+  // Root table -> vtable -> recordBatches (field 3) -> vector of Block.
+  std::optional<uint32_t> Root = Read32(0);
+  if (!Root)
+    return Malformed();
+  std::optional<uint32_t> VTableDelta = Read32(*Root);
+  if (!VTableDelta || int32_t(*VTableDelta) > int32_t(*Root))
+    return Malformed();
+  size_t VTable = *Root - int32_t(*VTableDelta);
+  if (VTable + 4 > Footer.size())
+    return Malformed();
+  uint16_t VTableSize = endian::read16le(Footer.data() + VTable);
+  if (VTableSize < 4 + 2 * 4 || VTable + VTableSize > Footer.size())
+    return Malformed();
+  uint16_t FieldOffset = endian::read16le(Footer.data() + VTable + 4 + 2 * 3);
+  if (!FieldOffset)
+    return Blocks;
+  size_t Slot = *Root + FieldOffset;
+  std::optional<uint32_t> VectorDelta = Read32(Slot);
+  if (!VectorDelta)
+    return Malformed();
+  size_t Vector = Slot + *VectorDelta;
+  std::optional<uint32_t> Count = Read32(Vector);
+  if (!Count || Vector + 4 + size_t(*Count) * 24 > Footer.size())
+    return Malformed();
+  for (uint32_t I = 0; I < *Count; ++I) {
+    const char *B = Footer.data() + Vector + 4 + I * 24;
+    Blocks.push_back({static_cast<int64_t>(endian::read64le(B)),
+                      static_cast<int32_t>(endian::read32le(B + 8)),
+                      static_cast<int64_t>(endian::read64le(B + 16))});
+  }
+  return Blocks;
+}
+
+} // namespace loopfeatures
@@ -0,0 +1,65 @@
+#ifndef LOOP_FEATURE_ARROW_WRITER_H
+#define LOOP_FEATURE_ARROW_WRITER_H
+
+#include "FeatureFile.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Apache Arrow IPC file (Feather v2) output, encoded by hand so the plugin
+// does not depend on the Arrow C++ library.
+//
+// Int32/Int64 columns map to Arrow Int(32/64, signed) and string columns to
+// Utf8; nothing is nullable. Each committed module becomes one record batch.
+// Arrow keeps the list of record batches in a footer at the end of the file.
+// Appending a module cuts the file back to the start of the old footer and
+// writes the new record batch there, followed by a complete new footer, so
+// the file holds exactly one footer and is valid after every append. An
+// append interrupted between the two leaves a file without a footer; the
+// next append then starts a new footer and only lists its own batches.
+namespace loopfeatures {
+
+// Location of one message in the file, as recorded in the footer.
+struct ArrowBlock {
+  int64_t Offset;
+  int32_t MetaDataLength;
+  int64_t BodyLength;
+};
+
+// Writes the file magic and the schema message.
+void writeArrowFileHeader(llvm::raw_ostream &OS,
+                          llvm::ArrayRef<ColumnDesc> Schema);
+
+// Writes Chunk as a record batch message starting at file offset Offset,
+// records it in Blocks and writes a footer listing all of Blocks.
+void writeArrowRecordBatch(llvm::raw_ostream &OS, uint64_t Offset,
+                           const FeatureChunkBuilder &Chunk,
+                           std::vector<ArrowBlock> &Blocks);
+
+// The Arrow IPC streaming format, for outputs that cannot be read back or
+// rewritten such as pipes: the schema message, one record batch message per
+// chunk and an end-of-stream marker, without the file magic and footer.
+void writeArrowStreamHeader(llvm::raw_ostream &OS,
+                            llvm::ArrayRef<ColumnDesc> Schema);
+void writeArrowStreamRecordBatch(llvm::raw_ostream &OS,
+                                 const FeatureChunkBuilder &Chunk);
+void writeArrowStreamEnd(llvm::raw_ostream &OS);
+
+// Reads the record batch blocks from the footer of the Arrow file in Buffer,
+// as written by writeArrowRecordBatch. A file that has no footer yet yields
+// no blocks.
+llvm::Expected<std::vector<ArrowBlock>>
+readArrowRecordBatchBlocks(const llvm::MemoryBuffer &Buffer);
+
+// The offset the footer of the Arrow file in Buffer starts at, which is where
+// the next record batch goes, or std::nullopt if it has no footer yet.
+std::optional<uint64_t> getArrowFooterOffset(const llvm::MemoryBuffer &Buffer);
+
+} // namespace loopfeatures
+
+#endif
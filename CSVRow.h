@@ -0,0 +1,53 @@
+#ifndef LOOP_FEATURE_CSV_ROW_H
+#define LOOP_FEATURE_CSV_ROW_H
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include <charconv>
+#include <cstdint>
+
+namespace loopfeatures {
+
+// Formats one CSV row into a buffer that is reused across rows, writing
+// names straight from their StringRefs and integers with std::to_chars so
+// that emitting a row does not allocate.
+class CSVRowSerializer {
+public:
+  CSVRowSerializer &field(llvm::StringRef S) {
+    separate();
+    Buf.append(S.begin(), S.end());
+    return *this;
+  }
+
+  CSVRowSerializer &field(int64_t V) {
+    separate();
+    char Digits[24];
+    auto Res = std::to_chars(Digits, Digits + sizeof(Digits), V);
+    Buf.append(Digits, Res.ptr);
+    return *this;
+  }
+
+  // Terminates the row and returns it; the next field() starts a new row.
+  llvm::StringRef finish() {
+    Buf.push_back('\n');
+    Ended = true;
+    return Buf;
+  }
+
+private:
+  void separate() {
+    if (Ended) {
+      Buf.clear();
+      Ended = false;
+    } else if (!Buf.empty()) {
+      Buf.push_back(',');
+    }
+  }
+
+  llvm::SmallString<256> Buf;
+  bool Ended = false;
+};
+
+} // namespace loopfeatures
+
+#endif
@@ -0,0 +1,256 @@
+#include "FeatureFile.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace llvm;
+
+namespace loopfeatures {
+
+static size_t columnWidth(ColumnType Type) {
+  return Type == ColumnType::Int64 ? sizeof(int64_t) : sizeof(int32_t);
+}
+
+static void padTo8(raw_ostream &OS, uint64_t Size) {
+  static const char Zeros[8] = {};
+  OS.write(Zeros, alignTo(Size, 8) - Size);
+}
+
+void writeFileHeader(raw_ostream &OS, ArrayRef<ColumnDesc> Schema) {
+  support::endian::Writer W(OS, support::little);
+  OS.write(FileMagic, sizeof(FileMagic));
+  W.write<uint16_t>(FormatVersion);
+  W.write<uint16_t>(Schema.size());
+  uint64_t Size = sizeof(FileMagic) + 4;
+  for (const ColumnDesc &C : Schema) {
+    size_t Len = std::strlen(C.Name);
+    assert(Len <= UINT8_MAX && "column name too long");
+    W.write<uint8_t>(static_cast<uint8_t>(C.Type));
+    W.write<uint8_t>(Len);
+    OS.write(C.Name, Len);
+    Size += 2 + Len;
+  }
+  padTo8(OS, Size);
+}
+
+FeatureChunkBuilder::FeatureChunkBuilder(ArrayRef<ColumnDesc> Schema)
+    : Schema(Schema.begin(), Schema.end()), Int32Columns(Schema.size()),
+      Int64Columns(Schema.size()), StringColumns(Schema.size()) {}
+
+FeatureChunkBuilder &FeatureChunkBuilder::field(StringRef S) {
+  assert(Schema[NextColumn].Type == ColumnType::String &&
+         "string field for a numeric column");
+  auto Ins = StringOffsets.try_emplace(S, StringTable.size());
+  if (Ins.second) {
+    StringTable.append(S.begin(), S.end());
+    StringTable.push_back('\0');
+  }
+  StringColumns[NextColumn++].push_back(Ins.first->second);
+  return *this;
+}
+
+FeatureChunkBuilder &FeatureChunkBuilder::field(int64_t V) {
+  assert(Schema[NextColumn].Type != ColumnType::String &&
+         "numeric field for a string column");
+  if (Schema[NextColumn].Type == ColumnType::Int64)
+    Int64Columns[NextColumn++].push_back(V);
+  else
+    Int32Columns[NextColumn++].push_back(static_cast<int32_t>(V));
+  return *this;
+}
+
+void FeatureChunkBuilder::finish() {
+  assert(NextColumn == Schema.size() && "row does not match the schema");
+  NextColumn = 0;
+  ++NumRows;
+}
+
+void FeatureChunkBuilder::setColumn(unsigned Col, int64_t V) {
+  assert(Schema[Col].Type != ColumnType::String &&
+         "numeric value for a string column");
+  if (Schema[Col].Type == ColumnType::Int64)
+    std::fill(Int64Columns[Col].begin(), Int64Columns[Col].end(), V);
+  else
+    std::fill(Int32Columns[Col].begin(), Int32Columns[Col].end(),
+              static_cast<int32_t>(V));
+}
+
+void FeatureChunkBuilder::encode(raw_ostream &OS) const {
+  support::endian::Writer W(OS, support::little);
+  OS.write(ChunkMagic, sizeof(ChunkMagic));
+  W.write<uint32_t>(NumRows);
+  W.write<uint32_t>(StringTable.size());
+  W.write<uint32_t>(0);
+  for (unsigned Col = 0; Col < Schema.size(); ++Col) {
+    switch (Schema[Col].Type) {
+    case ColumnType::Int32:
+      W.write(getInt32Column(Col));
+      break;
+    case ColumnType::Int64:
+      W.write(getInt64Column(Col));
+      break;
+    case ColumnType::String:
+      W.write(getStringColumn(Col));
+      break;
+    }
+    padTo8(OS, NumRows * columnWidth(Schema[Col].Type));
+  }
+  OS << StringTable;
+  padTo8(OS, StringTable.size());
+}
+
+ArrayRef<int32_t> FeatureChunkBuilder::getInt32Column(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::Int32 && "not an int32 column");
+  return Int32Columns[Col];
+}
+
+ArrayRef<int64_t> FeatureChunkBuilder::getInt64Column(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::Int64 && "not an int64 column");
+  return Int64Columns[Col];
+}
+
+ArrayRef<uint32_t> FeatureChunkBuilder::getStringColumn(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::String && "not a string column");
+  return StringColumns[Col];
+}
+
+void FeatureChunkBuilder::clear() {
+  for (unsigned Col = 0; Col < Schema.size(); ++Col) {
+    Int32Columns[Col].clear();
+    Int64Columns[Col].clear();
+    StringColumns[Col].clear();
+  }
+  StringOffsets.clear();
+  StringOffsets.getAllocator().Reset();
+  StringTable.clear();
+  NumRows = 0;
+}
+
+ArrayRef<int32_t> FeatureChunk::getInt32Column(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::Int32 && "not an int32 column");
+  auto *Data = reinterpret_cast<const int32_t *>(ColumnData[Col]);
+  return ArrayRef<int32_t>(Data, NumRows);
+}
+
+ArrayRef<int64_t> FeatureChunk::getInt64Column(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::Int64 && "not an int64 column");
+  auto *Data = reinterpret_cast<const int64_t *>(ColumnData[Col]);
+  return ArrayRef<int64_t>(Data, NumRows);
+}
+
+ArrayRef<uint32_t> FeatureChunk::getStringColumn(unsigned Col) const {
+  assert(Schema[Col].Type == ColumnType::String && "not a string column");
+  auto *Data = reinterpret_cast<const uint32_t *>(ColumnData[Col]);
+  return ArrayRef<uint32_t>(Data, NumRows);
+}
+
+StringRef FeatureChunk::getString(unsigned Col, size_t Row) const {
+  uint32_t Offset = getStringColumn(Col)[Row];
+  return StringRef(StringTable.data() + Offset);
+}
+
+Expected<std::unique_ptr<FeatureFileReader>>
+FeatureFileReader::open(StringRef Path) {
+  if (!sys::IsLittleEndianHost)
+    return createStringError(inconvertibleErrorCode(),
+                             "feature files can only be mapped on "
+                             "little-endian hosts");
+  auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                        /*RequiresNullTerminator=*/false);
+  if (!BufOrErr)
+    return createFileError(Path, BufOrErr.getError());
+  std::unique_ptr<FeatureFileReader> Reader(new FeatureFileReader());
+  Reader->Buffer = std::move(*BufOrErr);
+  if (Error E = Reader->parse())
+    return createFileError(Path, std::move(E));
+  return std::move(Reader);
+}
+
+static Error malformed(const Twine &Msg) {
+  return createStringError(inconvertibleErrorCode(), Msg);
+}
+
+Error FeatureFileReader::parse() {
+  const char *Start = Buffer->getBufferStart();
+  const char *End = Buffer->getBufferEnd();
+  const char *P = Start;
+  auto Remaining = [&] { return static_cast<size_t>(End - P); };
+  using namespace support;
+
+  if (Remaining() < sizeof(FileMagic) + 4 ||
+      std::memcmp(P, FileMagic, sizeof(FileMagic)) != 0)
+    return malformed("not a loop feature file");
+  P += sizeof(FileMagic);
+  uint16_t Version = endian::read16le(P);
+  uint16_t NumColumns = endian::read16le(P + 2);
+  P += 4;
+  if (Version != FormatVersion)
+    return malformed("unsupported feature file version " + Twine(Version));
+
+  for (unsigned Col = 0; Col < NumColumns; ++Col) {
+    if (Remaining() < 2 || Remaining() < 2u + uint8_t(P[1]))
+      return malformed("truncated schema");
+    auto Type = static_cast<ColumnType>(P[0]);
+    if (Type != ColumnType::Int32 && Type != ColumnType::Int64 &&
+        Type != ColumnType::String)
+      return malformed("unknown column type");
+    ColumnNames.emplace_back(P + 2, uint8_t(P[1]));
+    Schema.push_back({nullptr, Type});
+    P += 2 + uint8_t(P[1]);
+  }
+  for (unsigned Col = 0; Col < NumColumns; ++Col)
+    Schema[Col].Name = ColumnNames[Col].c_str();
+  P = Start + alignTo(P - Start, 8);
+
+  while (P < End) {
+    if (Remaining() < 16 || std::memcmp(P, ChunkMagic, 4) != 0)
+      return malformed("bad chunk header at offset " + Twine(P - Start));
+    FeatureChunk Chunk;
+    Chunk.Schema = Schema.data();
+    Chunk.NumRows = endian::read32le(P + 4);
+    uint32_t StringTableSize = endian::read32le(P + 8);
+    P += 16;
+    for (const ColumnDesc &C : Schema) {
+      size_t Size = alignTo(Chunk.NumRows * columnWidth(C.Type), 8);
+      if (Remaining() < Size)
+        return malformed("truncated column");
+      Chunk.ColumnData.push_back(P);
+      P += Size;
+    }
+    if (Remaining() < alignTo(StringTableSize, 8))
+      return malformed("truncated string table");
+    Chunk.StringTable = StringRef(P, StringTableSize);
+    if (StringTableSize && Chunk.StringTable.back() != '\0')
+      return malformed("unterminated string table");
+    // getString() reads up to the next NUL, which the check above
+    // guarantees for every offset inside the table.
+    for (unsigned Col = 0; Col < NumColumns; ++Col)
+      if (Schema[Col].Type == ColumnType::String)
+        for (uint32_t Offset : Chunk.getStringColumn(Col))
+          if (Offset >= StringTableSize)
+            return malformed("string offset out of range at offset " +
+                             Twine(P - Start));
+    P += alignTo(StringTableSize, 8);
+    Chunks.push_back(std::move(Chunk));
+  }
+  return Error::success();
+}
+
+int FeatureFileReader::findColumn(StringRef Name) const {
+  for (unsigned Col = 0; Col < ColumnNames.size(); ++Col)
+    if (ColumnNames[Col] == Name)
+      return Col;
+  return -1;
+}
+
+size_t FeatureFileReader::getNumRows() const {
+  size_t Rows = 0;
+  for (const FeatureChunk &Chunk : Chunks)
+    Rows += Chunk.getNumRows();
+  return Rows;
+}
+
+} // namespace loopfeatures
@@ -0,0 +1,139 @@
+#ifndef LOOP_FEATURE_FILE_H
+#define LOOP_FEATURE_FILE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Columnar binary feature files (.lfb).
+//
+// A file starts with a header naming the magic, format version and the
+// schema (one type and name per column, in CSV header order). It is followed
+// by any number of chunks, one per committed module, so several runs can
+// append to the same file. A chunk holds its row count, every column as a
+// contiguous little-endian array and a string table that string columns
+// index into with uint32 offsets. Every column starts on an 8-byte boundary
+// so a reader can use the mapped bytes in place.
+namespace loopfeatures {
+
+enum class ColumnType : uint8_t { Int32 = 1, Int64 = 2, String = 3 };
+
+struct ColumnDesc {
+  const char *Name;
+  ColumnType Type;
+};
+
+constexpr char FileMagic[4] = {'L', 'F', 'X', 'B'};
+constexpr char ChunkMagic[4] = {'L', 'F', 'X', 'C'};
+constexpr uint16_t FormatVersion = 1;
+
+// Writes the file header describing Schema.
+void writeFileHeader(llvm::raw_ostream &OS, llvm::ArrayRef<ColumnDesc> Schema);
+
+// In-memory feature table of one module, stored as a struct of arrays: each
+// column is a contiguous vector of its own type, int32, int64 or uint32
+// string table offsets, so batch consumers can loop over a column directly.
+// Rows are added field by field in schema order, the same way
+// CSVRowSerializer builds a CSV row, and encode() writes the table as one
+// chunk.
+class FeatureChunkBuilder {
+public:
+  explicit FeatureChunkBuilder(llvm::ArrayRef<ColumnDesc> Schema);
+
+  FeatureChunkBuilder &field(llvm::StringRef S);
+  FeatureChunkBuilder &field(int64_t V);
+  void finish();
+  // Sets the Int32 or Int64 column Col of every finished row to V, for a
+  // value that is only known after the rows were added.
+  void setColumn(unsigned Col, int64_t V);
+
+  size_t getNumRows() const { return NumRows; }
+  llvm::ArrayRef<ColumnDesc> getSchema() const { return Schema; }
+
+  // Column accessors, matching those of FeatureChunk.
+  llvm::ArrayRef<int32_t> getInt32Column(unsigned Col) const;
+  llvm::ArrayRef<int64_t> getInt64Column(unsigned Col) const;
+  llvm::ArrayRef<uint32_t> getStringColumn(unsigned Col) const;
+  llvm::StringRef getString(unsigned Col, size_t Row) const {
+    return StringTable.c_str() + getStringColumn(Col)[Row];
+  }
+  // Value of an Int32 or Int64 column.
+  int64_t getValue(unsigned Col, size_t Row) const {
+    return Schema[Col].Type == ColumnType::Int64 ? Int64Columns[Col][Row]
+                                                 : Int32Columns[Col][Row];
+  }
+
+  // Appends a chunk holding all finished rows to OS. The rows stay in the
+  // table until clear(), so other outputs can be written from it too.
+  void encode(llvm::raw_ostream &OS) const;
+  // Drops all finished rows without encoding them.
+  void clear();
+
+private:
+  llvm::SmallVector<ColumnDesc, 32> Schema;
+  // Indexed by column; only the vector matching the column type is used.
+  std::vector<std::vector<int32_t>> Int32Columns;
+  std::vector<std::vector<int64_t>> Int64Columns;
+  std::vector<std::vector<uint32_t>> StringColumns;
+  // Interned strings are allocated from an arena that clear() resets.
+  llvm::StringMap<uint32_t, llvm::BumpPtrAllocator> StringOffsets;
+  std::string StringTable;
+  unsigned NextColumn = 0;
+  size_t NumRows = 0;
+};
+
+// Read-only view of one chunk. Columns are returned as spans over the mapped
+// file, so nothing is copied.
+class FeatureChunk {
+public:
+  size_t getNumRows() const { return NumRows; }
+
+  llvm::ArrayRef<int32_t> getInt32Column(unsigned Col) const;
+  llvm::ArrayRef<int64_t> getInt64Column(unsigned Col) const;
+  // The uint32 string table offsets of a string column.
+  llvm::ArrayRef<uint32_t> getStringColumn(unsigned Col) const;
+  llvm::StringRef getString(unsigned Col, size_t Row) const;
+
+private:
+  friend class FeatureFileReader;
+
+  const ColumnDesc *Schema = nullptr;
+  size_t NumRows = 0;
+  llvm::SmallVector<const char *, 32> ColumnData;
+  llvm::StringRef StringTable;
+};
+
+// Maps a .lfb file and indexes its chunks.
+class FeatureFileReader {
+public:
+  static llvm::Expected<std::unique_ptr<FeatureFileReader>>
+  open(llvm::StringRef Path);
+
+  llvm::ArrayRef<ColumnDesc> getSchema() const { return Schema; }
+  // Returns the index of the column called Name, or -1.
+  int findColumn(llvm::StringRef Name) const;
+
+  llvm::ArrayRef<FeatureChunk> chunks() const { return Chunks; }
+  size_t getNumRows() const;
+
+private:
+  llvm::Error parse();
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  std::vector<std::string> ColumnNames;
+  std::vector<ColumnDesc> Schema;
+  std::vector<FeatureChunk> Chunks;
+};
+
+} // namespace loopfeatures
+
+#endif
@@ -0,0 +1,608 @@
+#include "FeatureSink.h"
+#include "ArrowWriter.h"
+#include "CSVRow.h"
+#include "NpyWriter.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Signals.h"
+#include <algorithm>
+
+using namespace llvm;
+using namespace loopfeatures;
+
+static cl::opt<unsigned> FlushThreshold(
+    "loop-features-flush-bytes", cl::init(1 << 20),
+    cl::desc("Bytes of pending feature rows kept in memory before they are "
+             "spilled to a temporary file"));
+
+raw_ostream &loopfeatures::logStream(LogLevel Verbosity, LogLevel Level) {
+  return Level <= Verbosity ? errs() : nulls();
+}
+
+bool loopfeatures::isStreamPath(StringRef Path) {
+  return Path == "-" || Path.startswith("fd:");
+}
+
+int loopfeatures::getStreamFD(StringRef Path) {
+  int FD;
+  if (Path == "-")
+    return 1;
+  if (!Path.consume_front("fd:") || Path.getAsInteger(10, FD) || FD < 0)
+    return -1;
+  return FD;
+}
+
+void RecordBatchWriter::append(StringRef Row) {
+  Pending.append(Row.data(), Row.size());
+  if (Pending.size() >= FlushThreshold)
+    spill();
+}
+
+ErrorOr<std::unique_ptr<MemoryBuffer>> RecordBatchWriter::readOutput() const {
+  return MemoryBuffer::getOpenFile(FD, OutPath, getFileSize(),
+                                   /*RequiresNullTerminator=*/false);
+}
+
+void RecordBatchWriter::truncate(uint64_t Size) {
+  Out->flush();
+  if (std::error_code EC = sys::fs::resize_file(FD, Size))
+    logStream(Verbosity, LogLevel::Error) << "Error: Could not truncate "
+                                          << OutPath << ": " << EC.message()
+                                          << "\n";
+}
+
+bool RecordBatchWriter::commit(function_ref<bool(uint64_t Offset)> Prepare,
+                               function_ref<void()> Finish) {
+  if (!open()) {
+    // Nowhere to write them to.
+    discard();
+    return false;
+  }
+  if (IsStream) {
+    writeStreamHeader();
+    if (Prepare && !Prepare(Out->tell() - StreamStart + Pending.size())) {
+      discard();
+      return false;
+    }
+    Out->write(Pending.data(), Pending.size());
+    Out->flush();
+    Pending.clear();
+    if (Finish)
+      Finish();
+    return true;
+  }
+
+  Expected<sys::fs::FileLocker> Lock = Out->lock();
+  if (!Lock)
+    logAllUnhandledErrors(Lock.takeError(),
+                          logStream(Verbosity, LogLevel::Warning),
+                          "Warning: Appending to " + OutPath +
+                              " without a lock: ");
+
+  uint64_t Offset = getFileSize();
+  if (Offset == 0) {
+    Out->write(Header.data(), Header.size());
+    Offset = Header.size();
+  } else if (!checkHeader()) {
+    logStream(Verbosity, LogLevel::Error)
+        << "Error: " << OutPath << " was written with other columns or in "
+        << "another format, not appending to it\n";
+    OpenFailed = true;
+    discard();
+    return false;
+  }
+  HeaderChecked = true;
+  if (Prepare && !Prepare(Offset + SpilledBytes + Pending.size())) {
+    discard();
+    return false;
+  }
+
+  bool Written = true;
+  if (!SpillPath.empty()) {
+    spill();
+    SpillOS.reset();
+    if (auto Buf = MemoryBuffer::getFile(SpillPath)) {
+      Out->write((*Buf)->getBufferStart(), (*Buf)->getBufferSize());
+    } else {
+      logStream(Verbosity, LogLevel::Error) << "Error: Could not read back " << SpillPath << "\n";
+      Written = false;
+    }
+    removeSpill();
+  }
+  Out->write(Pending.data(), Pending.size());
+  Out->flush();
+  Pending.clear();
+  if (Finish)
+    Finish();
+  return Written;
+}
+
+void RecordBatchWriter::discard() {
+  Pending.clear();
+  removeSpill();
+}
+
+RecordBatchWriter::~RecordBatchWriter() { removeSpill(); }
+
+bool RecordBatchWriter::open() {
+  if (Out || OpenFailed)
+    return !OpenFailed;
+  logStream(Verbosity, LogLevel::Info) << "Initializing " << OutPath << "\n";
+  sys::fs::file_status Status;
+  if (isStreamPath(OutPath)) {
+    FD = getStreamFD(OutPath);
+    if (FD < 0 || sys::fs::status(FD, Status)) {
+      logStream(Verbosity, LogLevel::Error)
+          << "Error: Could not write to " << OutPath << "\n";
+      OpenFailed = true;
+      return false;
+    }
+    // The descriptor belongs to whoever handed it to us.
+    Out = std::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/false);
+    IsStream = true;
+  } else {
+    if (sys::fs::openFileForReadWrite(OutPath, FD, sys::fs::CD_OpenAlways,
+                                      sys::fs::OF_Append)) {
+      logStream(Verbosity, LogLevel::Error)
+          << "Error: Could not open " << OutPath << "\n";
+      OpenFailed = true;
+      return false;
+    }
+    Out = std::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/true);
+    IsStream = !sys::fs::status(FD, Status) &&
+               Status.type() != sys::fs::file_type::regular_file;
+  }
+  StreamStart = Out->tell();
+  logStream(Verbosity, LogLevel::Info) << OutPath << " opened successfully\n";
+  return true;
+}
+
+void RecordBatchWriter::writeStreamHeader() {
+  if (StreamHeaderWritten)
+    return;
+  const std::string &H = StreamHeader ? *StreamHeader : Header;
+  Out->write(H.data(), H.size());
+  StreamHeaderWritten = true;
+}
+
+void RecordBatchWriter::spill() {
+  if (!open()) {
+    // commit() would drop them anyway.
+    Pending.clear();
+    return;
+  }
+  if (IsStream) {
+    writeStreamHeader();
+    Out->write(Pending.data(), Pending.size());
+    Pending.clear();
+    return;
+  }
+  if (!SpillOS) {
+    // Without a spill file the rows stay in memory until commit().
+    if (SpillFailed)
+      return;
+    int FD;
+    SmallString<128> Path;
+    if (std::error_code EC =
+            sys::fs::createUniqueFile(OutPath + "-%%%%%%.tmp", FD, Path)) {
+      logStream(Verbosity, LogLevel::Warning)
+          << "Warning: Could not create spill file for " << OutPath << ": "
+          << EC.message() << ", keeping pending rows in memory\n";
+      SpillFailed = true;
+      return;
+    }
+    SpillPath = std::string(Path);
+    sys::RemoveFileOnSignal(SpillPath);
+    SpillOS = std::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/true);
+  }
+  SpillOS->write(Pending.data(), Pending.size());
+  SpilledBytes += Pending.size();
+  Pending.clear();
+}
+
+void RecordBatchWriter::removeSpill() {
+  if (SpillPath.empty())
+    return;
+  SpillOS.reset();
+  sys::fs::remove(SpillPath);
+  sys::DontRemoveFileOnSignal(SpillPath);
+  SpillPath.clear();
+  SpilledBytes = 0;
+}
+
+bool RecordBatchWriter::checkHeader() {
+  if (HeaderChecked)
+    return true;
+  auto Existing = MemoryBuffer::getOpenFileSlice(
+      sys::fs::convertFDToNativeFile(FD), OutPath, Header.size(), 0);
+  if (!Existing || (*Existing)->getBufferSize() != Header.size())
+    return false;
+  StringRef Found = (*Existing)->getBuffer();
+  return HeaderMatches ? HeaderMatches(Found) : Found == Header;
+}
+
+uint64_t RecordBatchWriter::getFileSize() const {
+  sys::fs::file_status Status;
+  if (sys::fs::status(FD, Status))
+    return 0;
+  return Status.getSize();
+}
+
+namespace {
+// Appends the first NumCols columns of every row in Batch to Out as CSV.
+static void appendCSVRows(const FeatureChunkBuilder &Batch, unsigned NumCols,
+                          CSVRowSerializer &Row, RecordBatchWriter &Out) {
+  for (size_t R = 0; R < Batch.getNumRows(); ++R) {
+    for (unsigned Col = 0; Col < NumCols; ++Col) {
+      if (Batch.getSchema()[Col].Type == ColumnType::String)
+        Row.field(Batch.getString(Col, R));
+      else
+        Row.field(Batch.getValue(Col, R));
+    }
+    Out.append(Row.finish());
+  }
+}
+
+// Adds the ModuleHash column of a CSV file to Known.
+static void readKnownModulesFromCSV(const Twine &Path,
+                                    DenseSet<uint64_t> &Known) {
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return;
+  SmallVector<StringRef, 32> Fields;
+  int HashColumn = -1;
+  for (line_iterator Line(**Buf); !Line.is_at_end(); ++Line) {
+    Fields.clear();
+    Line->split(Fields, ',');
+    if (HashColumn < 0) {
+      auto It = find(Fields, "ModuleHash");
+      if (It == Fields.end())
+        return;
+      HashColumn = It - Fields.begin();
+      continue;
+    }
+    int64_t Hash;
+    if (HashColumn < (int)Fields.size() &&
+        !Fields[HashColumn].getAsInteger(10, Hash))
+      Known.insert(Hash);
+  }
+}
+
+// A sink appending to a file, one locked commit per module with rows.
+class FileSink : public FeatureSink {
+public:
+  FileSink(StringRef Path, std::string Header, LogLevel Verbosity,
+           std::optional<std::string> StreamHeader = std::nullopt)
+      : Path(Path.str()), Verbosity(Verbosity),
+        OutFile(Path, std::move(Header), Verbosity, std::move(StreamHeader)) {}
+
+  std::optional<bool> containsModule(uint64_t ModuleHash) override {
+    // Nothing can be read back from a stream or a pipe.
+    sys::fs::file_status Status;
+    if (isStreamPath(Path) ||
+        (!sys::fs::status(Path, Status) &&
+         Status.type() != sys::fs::file_type::regular_file))
+      return std::nullopt;
+    if (!KnownModulesLoaded) {
+      KnownModulesLoaded = true;
+      readKnownModules(KnownModules);
+    }
+    return KnownModules.contains(ModuleHash);
+  }
+
+protected:
+  raw_ostream &log(LogLevel Level) { return logStream(Verbosity, Level); }
+
+  // Adds the ModuleHash of every row already in the output to Known.
+  virtual void readKnownModules(DenseSet<uint64_t> &Known) = 0;
+
+  std::string Path;
+  LogLevel Verbosity;
+  RecordBatchWriter OutFile;
+  CSVRowSerializer Row;
+
+private:
+  DenseSet<uint64_t> KnownModules;
+  bool KnownModulesLoaded = false;
+};
+
+static std::string getCSVHeader(ArrayRef<ColumnDesc> Columns) {
+  CSVRowSerializer Row;
+  for (const ColumnDesc &C : Columns)
+    Row.field(C.Name);
+  return Row.finish().str();
+}
+
+class CSVSink : public FileSink {
+public:
+  CSVSink(StringRef Path, ArrayRef<ColumnDesc> Columns, LogLevel Verbosity)
+      : FileSink(Path, getCSVHeader(Columns), Verbosity) {}
+
+  bool write(const FeatureChunkBuilder &Batch) override {
+    if (!Batch.getNumRows())
+      return true;
+    appendCSVRows(Batch, Batch.getSchema().size(), Row, OutFile);
+    return OutFile.commit();
+  }
+
+private:
+  void readKnownModules(DenseSet<uint64_t> &Known) override {
+    readKnownModulesFromCSV(Path, Known);
+  }
+};
+
+// The header of a file in a format whose header only depends on the
+// columns.
+template <void (*WriteHeader)(raw_ostream &, ArrayRef<ColumnDesc>)>
+static std::string getFileHeader(ArrayRef<ColumnDesc> Columns) {
+  std::string Header;
+  raw_string_ostream HeaderOS(Header);
+  WriteHeader(HeaderOS, Columns);
+  return std::move(HeaderOS.str());
+}
+
+class BinarySink : public FileSink {
+public:
+  BinarySink(StringRef Path, ArrayRef<ColumnDesc> Columns, LogLevel Verbosity)
+      : FileSink(Path, getFileHeader<writeFileHeader>(Columns), Verbosity) {}
+
+  bool write(const FeatureChunkBuilder &Batch) override {
+    if (!Batch.getNumRows())
+      return true;
+    Batch.encode(OutFile.stream());
+    return OutFile.commit();
+  }
+
+private:
+  void readKnownModules(DenseSet<uint64_t> &Known) override {
+    auto Reader = FeatureFileReader::open(Path);
+    if (!Reader) {
+      consumeError(Reader.takeError());
+    } else if (int Col = (*Reader)->findColumn("ModuleHash"); Col >= 0) {
+      for (const FeatureChunk &C : (*Reader)->chunks())
+        for (int64_t Hash : C.getInt64Column(Col))
+          Known.insert(Hash);
+    }
+  }
+};
+
+class ArrowSink : public FileSink {
+public:
+  ArrowSink(StringRef Path, ArrayRef<ColumnDesc> Columns, LogLevel Verbosity)
+      : FileSink(Path, getFileHeader<writeArrowFileHeader>(Columns), Verbosity,
+                 getFileHeader<writeArrowStreamHeader>(Columns)) {}
+
+  // A stream is only complete with its end marker.
+  ~ArrowSink() override {
+    if (OutFile.isStream()) {
+      writeArrowStreamEnd(OutFile.stream());
+      OutFile.commit();
+    }
+  }
+
+  bool write(const FeatureChunkBuilder &Batch) override {
+    if (!Batch.getNumRows())
+      return true;
+    // The footer lists every record batch in the file, including those
+    // other processes appended since this one started, and the new batch
+    // overwrites the old footer. Streams use the Arrow streaming format
+    // instead, which has no footer.
+    return OutFile.commit([&](uint64_t Offset) {
+      if (OutFile.isStream()) {
+        writeArrowStreamRecordBatch(OutFile.stream(), Batch);
+        return true;
+      }
+      std::vector<ArrowBlock> Blocks;
+      auto Buf = OutFile.readOutput();
+      if (!Buf) {
+        log(LogLevel::Error) << "Error: Could not read " << Path << ": "
+                             << Buf.getError().message() << "\n";
+      } else if (auto Existing = readArrowRecordBatchBlocks(**Buf)) {
+        Blocks = std::move(*Existing);
+        if (std::optional<uint64_t> Footer = getArrowFooterOffset(**Buf)) {
+          Buf->reset();
+          OutFile.truncate(*Footer);
+          Offset = *Footer;
+        }
+        writeArrowRecordBatch(OutFile.stream(), Offset, Batch, Blocks);
+      } else {
+        logAllUnhandledErrors(Existing.takeError(), log(LogLevel::Error),
+                              "Error: ");
+      }
+      return true;
+    });
+  }
+
+  std::optional<bool> containsModule(uint64_t ModuleHash) override {
+    if (!Warned) {
+      Warned = true;
+      log(LogLevel::Warning)
+          << "Warning: -loop-features-skip-existing is not supported "
+          << "for Arrow output\n";
+    }
+    return std::nullopt;
+  }
+
+private:
+  void readKnownModules(DenseSet<uint64_t> &Known) override {}
+
+  bool Warned = false;
+};
+
+// The numeric columns go to the matrix at Path and the key columns to a CSV
+// index next to it, foo.npy getting foo.index.csv.
+class NpySink : public FileSink {
+public:
+  NpySink(StringRef Path, ArrayRef<ColumnDesc> Columns, unsigned NumKeyColumns,
+          LogLevel Verbosity)
+      : FileSink(Path, getNpyHeader(Columns.size() - NumKeyColumns), Verbosity),
+        IndexPath(getIndexPath(Path)),
+        IndexFile(IndexPath, getCSVHeader(Columns.take_front(NumKeyColumns)),
+                  Verbosity),
+        NumKeyColumns(NumKeyColumns) {
+    for (unsigned Col = NumKeyColumns; Col < Columns.size(); ++Col)
+      MatrixColumns.push_back(Col);
+    OutFile.setHeaderCheck([NumCols = MatrixColumns.size()](StringRef Header) {
+      return isNpyHeader(Header, NumCols);
+    });
+  }
+
+  bool write(const FeatureChunkBuilder &Batch) override {
+    if (!Batch.getNumRows())
+      return true;
+    appendCSVRows(Batch, NumKeyColumns, Row, IndexFile);
+    writeNpyRows(OutFile.stream(), Batch, MatrixColumns);
+    // The index is committed under the matrix's lock, so processes sharing
+    // the output append their modules to both files in the same order. The
+    // index lock is only ever taken inside the matrix lock. Rows the index
+    // does not take are not added to the matrix either, so the two never
+    // drift apart.
+    bool IndexCommitted = false;
+    bool Committed = OutFile.commit(
+        [&](uint64_t) {
+          IndexCommitted = IndexFile.commit();
+          return IndexCommitted;
+        },
+        [this] {
+          if (OutFile.isStream()) {
+            log(LogLevel::Error) << "Error: npy output cannot be streamed to "
+                                 << Path << "\n";
+            return;
+          }
+          if (Error E = updateNpyHeader(Path, MatrixColumns.size()))
+            logAllUnhandledErrors(std::move(E), log(LogLevel::Error), "Error: ");
+        });
+    // The matrix could not be opened, so its index rows are dropped too.
+    if (!IndexCommitted)
+      IndexFile.discard();
+    return Committed;
+  }
+
+private:
+  static std::string getNpyHeader(unsigned NumCols) {
+    std::string Header;
+    raw_string_ostream HeaderOS(Header);
+    writeNpyHeader(HeaderOS, 0, NumCols);
+    return std::move(HeaderOS.str());
+  }
+
+  static std::string getIndexPath(StringRef Path) {
+    SmallString<128> Index(Path);
+    sys::path::replace_extension(Index, "index.csv");
+    return std::string(Index);
+  }
+
+  void readKnownModules(DenseSet<uint64_t> &Known) override {
+    readKnownModulesFromCSV(IndexPath, Known);
+  }
+
+  std::string IndexPath;
+  RecordBatchWriter IndexFile;
+  unsigned NumKeyColumns;
+  std::vector<unsigned> MatrixColumns;
+};
+
+// Writes no rows, only a summary of every numeric column over all modules
+// written to it, when its output is destroyed: to Path if one is given and to
+// stderr otherwise.
+class StatsSink : public FeatureSink {
+public:
+  StatsSink(StringRef Path, ArrayRef<ColumnDesc> Columns,
+            unsigned NumKeyColumns)
+      : Path(Path.str()), Schema(Columns.begin(), Columns.end()),
+        NumKeyColumns(NumKeyColumns), Stats(Columns.size()) {}
+
+  bool write(const FeatureChunkBuilder &Batch) override {
+    ++NumModules;
+    NumRows += Batch.getNumRows();
+    for (unsigned Col = NumKeyColumns; Col < Schema.size(); ++Col) {
+      if (Schema[Col].Type == ColumnType::Int32)
+        for (int32_t V : Batch.getInt32Column(Col))
+          Stats[Col].add(V);
+      else
+        for (int64_t V : Batch.getInt64Column(Col))
+          Stats[Col].add(V);
+    }
+    return true;
+  }
+
+  ~StatsSink() override {
+    // Pass instances that never ran, such as those from parsing the
+    // pipeline only to validate it, have nothing to report.
+    if (!NumModules)
+      return;
+    std::error_code EC;
+    std::unique_ptr<raw_fd_ostream> File;
+    if (isStreamPath(Path)) {
+      sys::fs::file_status Status;
+      if (sys::fs::status(getStreamFD(Path), Status)) {
+        errs() << "Error: Could not write to " << Path << "\n";
+        return;
+      }
+      File = std::make_unique<raw_fd_ostream>(getStreamFD(Path),
+                                              /*shouldClose=*/false);
+    } else if (!Path.empty()) {
+      File = std::make_unique<raw_fd_ostream>(Path, EC);
+      if (EC) {
+        errs() << "Error: Could not open " << Path << "\n";
+        return;
+      }
+    }
+    raw_ostream &OS = File ? *File : errs();
+    OS << "loop-features: " << NumRows << " loops in " << NumModules
+       << " modules\n";
+    OS << left_justify("column", 24) << right_justify("sum", 14)
+       << right_justify("min", 12) << right_justify("max", 12)
+       << right_justify("mean", 12) << "\n";
+    for (unsigned Col = NumKeyColumns; Col < Schema.size(); ++Col) {
+      const ColumnStats &S = Stats[Col];
+      OS << left_justify(Schema[Col].Name, 24) << format_decimal(S.Sum, 14)
+         << format_decimal(NumRows ? S.Min : 0, 12)
+         << format_decimal(NumRows ? S.Max : 0, 12)
+         << format("%12.2f", NumRows ? double(S.Sum) / NumRows : 0.0) << "\n";
+    }
+  }
+
+private:
+  struct ColumnStats {
+    int64_t Sum = 0;
+    int64_t Min = INT64_MAX, Max = INT64_MIN;
+    void add(int64_t V) {
+      Sum += V;
+      Min = std::min(Min, V);
+      Max = std::max(Max, V);
+    }
+  };
+
+  std::string Path;
+  std::vector<ColumnDesc> Schema;
+  unsigned NumKeyColumns;
+  std::vector<ColumnStats> Stats;
+  uint64_t NumModules = 0, NumRows = 0;
+};
+} // namespace
+
+std::unique_ptr<FeatureSink>
+loopfeatures::createFeatureSink(const SinkOptions &Sink,
+                                ArrayRef<ColumnDesc> Columns,
+                                unsigned NumKeyColumns, LogLevel Verbosity) {
+  switch (Sink.Format) {
+  case OutputFormat::CSV:
+    return std::make_unique<CSVSink>(Sink.Path, Columns, Verbosity);
+  case OutputFormat::Binary:
+    return std::make_unique<BinarySink>(Sink.Path, Columns, Verbosity);
+  case OutputFormat::Arrow:
+    return std::make_unique<ArrowSink>(Sink.Path, Columns, Verbosity);
+  case OutputFormat::NumPy:
+    return std::make_unique<NpySink>(Sink.Path, Columns, NumKeyColumns,
+                                     Verbosity);
+  case OutputFormat::Stats:
+    return std::make_unique<StatsSink>(Sink.Path, Columns, NumKeyColumns);
+  }
+  llvm_unreachable("unknown output format");
+}
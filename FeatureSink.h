@@ -0,0 +1,174 @@
+#ifndef LOOP_FEATURE_SINK_H
+#define LOOP_FEATURE_SINK_H
+
+#include "FeatureFile.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+// The outputs of the loop-features pass. Each module's rows arrive as one
+// FeatureChunkBuilder and every sink writes them in its own format; the
+// file formats go through a RecordBatchWriter, which appends each module
+// under a lock so several processes can share an output.
+namespace loopfeatures {
+
+enum class OutputFormat { CSV, Binary, Arrow, NumPy, Stats };
+
+// Per-function and per-loop tracing goes through LLVM_DEBUG instead: it is
+// compiled out with NDEBUG and shown with -debug-only=loop-features (and
+// -debug-only=loop-features-analysis for the analysis).
+enum class LogLevel { Quiet, Error, Warning, Info };
+
+// Stream for a message at Level: errs() if Verbosity lets it through,
+// nulls() otherwise.
+llvm::raw_ostream &logStream(LogLevel Verbosity, LogLevel Level);
+
+// "-" is stdout and "fd:N" a file descriptor inherited from the parent.
+// Both are written as streams: front to back, without locking or reading
+// anything back.
+bool isStreamPath(llvm::StringRef Path);
+
+// The file descriptor a stream path names, or -1 if it is malformed.
+int getStreamFD(llvm::StringRef Path);
+
+// One output of a pass instance.
+struct SinkOptions {
+  OutputFormat Format;
+  // For stats, empty means stderr.
+  std::string Path;
+};
+
+// Collects the rows of one module and appends them to the output file on
+// commit(). Rows past -loop-features-flush-bytes are spilled to a temporary
+// file next to the output instead of the output itself, so a module's rows
+// become visible together or not at all. The output is only opened by the
+// first commit(), so a pass that never writes a row never touches it.
+//
+// Streams (see isStreamPath) and named pipes have no size to check and
+// nothing to read back. They get their header once, before the first rows,
+// and rows past the threshold go straight to them.
+//
+// Several opt processes may append to the same output, so commit() holds an
+// advisory lock on it while writing and emits the header only if it finds
+// the file empty under that lock. A file that does not start with the same
+// header, e.g. one written with other features= or by an older version, is
+// left alone rather than given rows of another schema.
+class RecordBatchWriter {
+public:
+  // Formats whose streams start differently from their files pass the
+  // stream's header as StreamHeader.
+  RecordBatchWriter(llvm::StringRef Path, std::string FileHeader,
+                    LogLevel Level,
+                    std::optional<std::string> StreamHeader = std::nullopt)
+      : OutPath(Path.str()), Header(std::move(FileHeader)),
+        StreamHeader(std::move(StreamHeader)), Verbosity(Level) {}
+  ~RecordBatchWriter();
+
+  // For formats whose header changes as rows are added: Matches tells
+  // whether the header found in an existing output fits this one, instead
+  // of comparing it byte for byte.
+  void setHeaderCheck(std::function<bool(llvm::StringRef)> Matches) {
+    HeaderMatches = std::move(Matches);
+  }
+
+  // Whether the output was opened as a stream.
+  bool isStream() const { return IsStream; }
+
+  llvm::raw_ostream &stream() { return PendingOS; }
+
+  // Adds one complete row; spills once the threshold is reached.
+  void append(llvm::StringRef Row);
+
+  // Maps the output as it is now. Only meaningful under commit()'s lock.
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> readOutput() const;
+
+  // Cuts the output back to Size bytes, so that what is written next lands
+  // at Size. Only meaningful in commit()'s Prepare, before anything was
+  // added to stream().
+  void truncate(uint64_t Size);
+
+  // Appends the header if the output is empty, then everything pending, all
+  // under the output's lock. Formats whose data depends on what other
+  // processes appended get the lock too: Prepare runs before the write with
+  // the offset anything it adds to stream() will land at, and can return
+  // false to drop everything pending instead; Finish runs after the write.
+  // Returns whether the pending rows were written.
+  bool commit(llvm::function_ref<bool(uint64_t Offset)> Prepare = nullptr,
+              llvm::function_ref<void()> Finish = nullptr);
+
+  // Drops everything pending without writing it.
+  void discard();
+
+private:
+  bool open();
+  void writeStreamHeader();
+  void spill();
+  void removeSpill();
+
+  // Whether a non-empty output starts with this writer's header, so rows
+  // with these columns can be appended to it. Checked under the lock of the
+  // first commit; later commits only append to what that one checked.
+  bool checkHeader();
+
+  uint64_t getFileSize() const;
+
+  std::string OutPath;
+  std::string Header;
+  std::optional<std::string> StreamHeader;
+  std::function<bool(llvm::StringRef)> HeaderMatches;
+  bool HeaderChecked = false;
+  LogLevel Verbosity;
+  int FD = -1;
+  std::unique_ptr<llvm::raw_fd_ostream> Out;
+  bool OpenFailed = false;
+  bool IsStream = false;
+  bool StreamHeaderWritten = false;
+  uint64_t StreamStart = 0;
+  std::string Pending;
+  llvm::raw_string_ostream PendingOS{Pending};
+  std::string SpillPath;
+  std::unique_ptr<llvm::raw_fd_ostream> SpillOS;
+  uint64_t SpilledBytes = 0;
+  // Set once creating a spill file failed, so it is neither retried nor
+  // reported for every row.
+  bool SpillFailed = false;
+};
+
+// Receives the features of each module as one batch of rows. A pass
+// instance can feed several sinks from one extraction, so another output
+// format does not need another run.
+class FeatureSink {
+public:
+  virtual ~FeatureSink() = default;
+
+  // Writes the rows of one module, possibly none. Sinks are created without
+  // touching their output and open it when the first rows arrive. Returns
+  // false if the rows were lost, e.g. because the output could not be
+  // opened or was written with other columns.
+  virtual bool write(const FeatureChunkBuilder &Batch) = 0;
+
+  // Whether the output already holds rows of the module with ModuleHash, or
+  // std::nullopt if this sink cannot tell.
+  virtual std::optional<bool> containsModule(uint64_t ModuleHash) {
+    return std::nullopt;
+  }
+};
+
+// The sink for Sink with the given Columns, whose first NumKeyColumns
+// identify a row (the npy index and the columns stats leaves out) and
+// include a ModuleHash column.
+std::unique_ptr<FeatureSink>
+createFeatureSink(const SinkOptions &Sink, llvm::ArrayRef<ColumnDesc> Columns,
+                  unsigned NumKeyColumns, LogLevel Verbosity);
+
+} // namespace loopfeatures
+
+#endif
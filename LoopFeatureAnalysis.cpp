@@ -0,0 +1,219 @@
+#include "LoopFeatureAnalysis.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <memory>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "loop-features-analysis"
+
+namespace loopfeatures {
+
+void LoopBodyCounts::addBlock(const BasicBlock &BB) {
+  num_blocks_in_lp++;
+  for (const Instruction &I : BB) {
+    unsigned Op = I.getOpcode();
+    ++Opcodes[Op];
+    num_operands += I.getNumOperands();
+    switch (Op) {
+    case Instruction::Br:
+      ends_with_branch = true;
+      if (cast<BranchInst>(I).isConditional())
+        ends_with_cond_branch = true;
+      break;
+    case Instruction::Ret:
+      ends_with_return = true;
+      break;
+    case Instruction::Unreachable:
+      ends_with_unreachable = true;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+LoopBodyCounts &LoopBodyCounts::operator+=(const LoopBodyCounts &Other) {
+  for (unsigned Op = 0; Op < NumOpcodes; ++Op)
+    Opcodes[Op] += Other.Opcodes[Op];
+  num_operands += Other.num_operands;
+  num_blocks_in_lp += Other.num_blocks_in_lp;
+  ends_with_unreachable |= Other.ends_with_unreachable;
+  ends_with_return |= Other.ends_with_return;
+  ends_with_cond_branch |= Other.ends_with_cond_branch;
+  ends_with_branch |= Other.ends_with_branch;
+  return *this;
+}
+
+// Returns N value-initialized T, allocated from Arena. Only used for
+// trivially destructible T, since the arena never runs destructors.
+template <typename T>
+static MutableArrayRef<T> allocateArray(BumpPtrAllocator &Arena, size_t N) {
+  T *Data = Arena.Allocate<T>(N);
+  std::uninitialized_value_construct_n(Data, N);
+  return MutableArrayRef<T>(Data, N);
+}
+
+static unsigned countLoops(const Loop *L) {
+  unsigned N = 1;
+  for (const Loop *SubLoop : *L)
+    N += countLoops(SubLoop);
+  return N;
+}
+
+void LoopNestIndex::compute(Function &F, LoopInfo &LI,
+                            BumpPtrAllocator &Arena) {
+  unsigned NumLoops = 0, NumLoopBlocks = 0;
+  for (const Loop *L : LI) {
+    NumLoops += countLoops(L);
+    NumLoopBlocks += L->getNumBlocks();
+  }
+  Loops = allocateArray<Loop *>(Arena, NumLoops);
+  Parents = allocateArray<unsigned>(Arena, NumLoops);
+  WordsPerRow = alignTo(NumLoops, 64) / 64;
+  Rows = allocateArray<uint64_t>(Arena, NumLoops * WordsPerRow);
+  // Sized up front so neither map grows while it is filled.
+  Numbers.clear();
+  Numbers.reserve(NumLoops);
+  BlockLoops.clear();
+  BlockLoops.reserve(NumLoopBlocks);
+
+  unsigned Next = 0;
+  for (Loop *L : reverse(LI))
+    number(L, NoLoop, Next);
+  for (BasicBlock &BB : F)
+    if (Loop *L = LI.getLoopFor(&BB))
+      BlockLoops[&BB] = Numbers[L];
+}
+
+// Numbers L and its subloops in preorder from Next on and fills in their
+// parents and membership rows.
+void LoopNestIndex::number(Loop *L, unsigned Parent, unsigned &Next) {
+  unsigned N = Next++;
+  Loops[N] = L;
+  Parents[N] = Parent;
+  Numbers[L] = N;
+  uint64_t *Row = &Rows[N * WordsPerRow];
+  if (Parent != NoLoop)
+    std::copy_n(&Rows[Parent * WordsPerRow], WordsPerRow, Row);
+  Row[N / 64] |= uint64_t(1) << (N % 64);
+  for (Loop *SubLoop : *L)
+    number(SubLoop, N, Next);
+}
+
+// Ancestors are numbered before their subloops, so the innermost common loop
+// is the highest bit set in both rows, and only the words up to the lower of
+// the two numbers can hold it.
+unsigned LoopNestIndex::findCommonLoop(unsigned A, unsigned B) const {
+  if (A == NoLoop || B == NoLoop)
+    return NoLoop;
+  if (A == B || contains(A, B))
+    return A;
+  const uint64_t *RowA = &Rows[A * WordsPerRow];
+  const uint64_t *RowB = &Rows[B * WordsPerRow];
+  for (unsigned W = std::min(A, B) / 64 + 1; W-- > 0;)
+    if (uint64_t Common = RowA[W] & RowB[W])
+      return W * 64 + 63 - countLeadingZeros(Common);
+  return NoLoop;
+}
+
+bool LoopFeatureInfo::invalidate(Function &F, const PreservedAnalyses &PA,
+                                 FunctionAnalysisManager::Invalidator &Inv) {
+  // The result points into LoopInfo, so it goes with it.
+  auto PAC = PA.getChecker<LoopFeatureAnalysis>();
+  return !(PAC.preserved() || PAC.preservedSet<AllAnalysesOn<Function>>()) ||
+         Inv.invalidate<LoopAnalysis>(F, PA);
+}
+
+// Counts a block once in Field of every loop on the root paths of Loops.
+// Adding 1 at each loop and subtracting 1 at the common loop of preorder
+// neighbours makes the subtree sums taken later come out to exactly 1 on the
+// union of those paths.
+static void countOnPaths(SmallVectorImpl<unsigned> &Loops,
+                         const LoopNestIndex &Nest,
+                         MutableArrayRef<LoopStats> Stats,
+                         int LoopStats::*Field) {
+  llvm::sort(Loops);
+  Loops.erase(std::unique(Loops.begin(), Loops.end()), Loops.end());
+  for (unsigned I = 0; I < Loops.size(); ++I) {
+    Stats[Loops[I]].*Field += 1;
+    if (I > 0) {
+      unsigned Common = Nest.findCommonLoop(Loops[I - 1], Loops[I]);
+      if (Common != LoopNestIndex::NoLoop)
+        Stats[Common].*Field -= 1;
+    }
+  }
+}
+
+AnalysisKey LoopFeatureAnalysis::Key;
+
+LoopFeatureInfo LoopFeatureAnalysis::run(Function &F,
+                                         FunctionAnalysisManager &FAM) {
+  return compute(F, FAM.getResult<LoopAnalysis>(F));
+}
+
+// Each block's instructions are counted once, for its innermost loop, and
+// the totals of subloops are then added into their parents bottom-up.
+LoopFeatureInfo LoopFeatureAnalysis::compute(Function &F, LoopInfo &LI) {
+  LoopFeatureInfo Info;
+  LoopNestIndex &Nest = Info.Nest;
+  Nest.compute(F, LI, Info.Arena);
+  Info.Stats = allocateArray<LoopStats>(Info.Arena, Nest.getNumLoops());
+  MutableArrayRef<LoopStats> Stats = Info.Stats;
+
+  SmallVector<unsigned, 4> Neighbours;
+  for (BasicBlock &BB : F) {
+    unsigned L = Nest.getLoopFor(&BB);
+    if (L != LoopNestIndex::NoLoop) {
+      Stats[L].Exclusive.addBlock(BB);
+      // A use is inside every loop that contains both ends of it.
+      for (Instruction &I : BB)
+        for (auto *U : I.users())
+          if (auto *UserI = dyn_cast<Instruction>(U)) {
+            unsigned Common =
+                Nest.findCommonLoop(L, Nest.getLoopFor(UserI->getParent()));
+            if (Common != LoopNestIndex::NoLoop)
+              Stats[Common].num_uses++;
+          }
+    }
+
+    // BB is a predecessor of each loop holding one of its successors, and a
+    // successor of each loop holding one of its predecessors.
+    Neighbours.clear();
+    for (BasicBlock *Succ : successors(&BB)) {
+      unsigned SuccL = Nest.getLoopFor(Succ);
+      if (SuccL != LoopNestIndex::NoLoop)
+        Neighbours.push_back(SuccL);
+    }
+    countOnPaths(Neighbours, Nest, Stats, &LoopStats::num_preds);
+    Neighbours.clear();
+    for (BasicBlock *Pred : predecessors(&BB)) {
+      unsigned PredL = Nest.getLoopFor(Pred);
+      if (PredL != LoopNestIndex::NoLoop)
+        Neighbours.push_back(PredL);
+    }
+    countOnPaths(Neighbours, Nest, Stats, &LoopStats::num_succ);
+  }
+
+  for (LoopStats &S : Stats)
+    S.Inclusive = S.Exclusive;
+  for (unsigned L = Nest.getNumLoops(); L-- > 0;) {
+    unsigned Parent = Nest.getParent(L);
+    if (Parent == LoopNestIndex::NoLoop)
+      continue;
+    LoopStats &Child = Stats[L], &Outer = Stats[Parent];
+    Outer.Inclusive += Child.Inclusive;
+    Outer.num_preds += Child.num_preds;
+    Outer.num_succ += Child.num_succ;
+    Outer.num_uses += Child.num_uses;
+  }
+  LLVM_DEBUG(dbgs() << "Computed features of " << Nest.getNumLoops()
+                    << " loops in " << F.getName() << "\n");
+  return Info;
+}
+
+} // namespace loopfeatures
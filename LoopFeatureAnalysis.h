@@ -0,0 +1,166 @@
+#ifndef LOOP_FEATURE_ANALYSIS_H
+#define LOOP_FEATURE_ANALYSIS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/Allocator.h"
+#include <array>
+#include <cstdint>
+#include <numeric>
+
+// Structural features of every loop in a function, computed as a function
+// analysis. The loop-features pass reads them from the
+// FunctionAnalysisManager, so other passes in the same pipeline that ask for
+// LoopFeatureAnalysis get the cached result instead of walking the IR again.
+// The result is dropped whenever the function or its LoopInfo changes.
+namespace loopfeatures {
+
+// Opcodes are numbered from 1 up to OtherOpsEnd, so this indexes a histogram
+// directly by Instruction::getOpcode().
+constexpr unsigned NumOpcodes = llvm::Instruction::OtherOpsEnd;
+
+// UserOp1/UserOp2 are placeholders for passes and never appear in IR.
+inline bool isHistogramOpcode(unsigned Op) {
+  return Op != 0 && Op != llvm::Instruction::UserOp1 &&
+         Op != llvm::Instruction::UserOp2;
+}
+
+// Counts over a set of blocks that add up across the loops of a nest. Each
+// instruction is counted in the histogram of its opcode; the per-kind counts
+// are sums over that histogram.
+struct LoopBodyCounts {
+  std::array<uint32_t, NumOpcodes> Opcodes = {};
+  int num_operands = 0, num_blocks_in_lp = 0;
+  bool ends_with_unreachable = false, ends_with_return = false;
+  bool ends_with_cond_branch = false, ends_with_branch = false;
+
+  void addBlock(const llvm::BasicBlock &BB);
+
+  int num_instr() const {
+    return std::accumulate(Opcodes.begin(), Opcodes.end(), 0);
+  }
+  int num_phis() const { return Opcodes[llvm::Instruction::PHI]; }
+  int num_calls() const {
+    return Opcodes[llvm::Instruction::Call] +
+           Opcodes[llvm::Instruction::Invoke] +
+           Opcodes[llvm::Instruction::CallBr];
+  }
+  int num_float_ops() const {
+    return Opcodes[llvm::Instruction::FAdd] + Opcodes[llvm::Instruction::FSub] +
+           Opcodes[llvm::Instruction::FMul] + Opcodes[llvm::Instruction::FDiv];
+  }
+  int nums_branchs() const { return Opcodes[llvm::Instruction::Br]; }
+  int num_memory_ops() const {
+    return Opcodes[llvm::Instruction::Load] +
+           Opcodes[llvm::Instruction::Store];
+  }
+
+  LoopBodyCounts &operator+=(const LoopBodyCounts &Other);
+};
+
+// Features of one loop. Exclusive covers the blocks whose innermost loop is
+// this one, Inclusive the whole body including subloops. The remaining
+// counts are inclusive.
+struct LoopStats {
+  LoopBodyCounts Exclusive, Inclusive;
+  int num_preds = 0, num_succ = 0, num_uses = 0;
+};
+
+// Dense numbering of the loops of one function. Loops are numbered in
+// preorder, so a loop always comes before its subloops, and the per-loop
+// tables are plain arrays indexed by that number, allocated from the arena
+// passed to compute().
+//
+// Each loop also has a membership row: a bitset of the loops on its path to
+// the root, itself included. A block belongs to exactly the loops in the row
+// of its innermost loop, so checking whether a loop contains a block is a bit
+// test and the loops containing two blocks are the AND of their rows.
+class LoopNestIndex {
+public:
+  static constexpr unsigned NoLoop = ~0u;
+
+  void compute(llvm::Function &F, llvm::LoopInfo &LI,
+               llvm::BumpPtrAllocator &Arena);
+
+  unsigned getNumLoops() const { return Loops.size(); }
+  llvm::Loop *getLoop(unsigned N) const { return Loops[N]; }
+  unsigned getParent(unsigned N) const { return Parents[N]; }
+
+  // Number of L, or NoLoop if L is not a loop of this function.
+  unsigned getNumber(const llvm::Loop *L) const {
+    auto It = Numbers.find(L);
+    return It == Numbers.end() ? NoLoop : It->second;
+  }
+
+  // Number of the innermost loop holding BB, or NoLoop.
+  unsigned getLoopFor(const llvm::BasicBlock *BB) const {
+    auto It = BlockLoops.find(BB);
+    return It == BlockLoops.end() ? NoLoop : It->second;
+  }
+
+  // Whether loop Outer contains loop Inner, or is Inner.
+  bool contains(unsigned Outer, unsigned Inner) const {
+    return Inner != NoLoop &&
+           (Rows[Inner * WordsPerRow + Outer / 64] >> (Outer % 64)) & 1;
+  }
+
+  // Innermost loop containing both A and B, or NoLoop.
+  unsigned findCommonLoop(unsigned A, unsigned B) const;
+
+private:
+  void number(llvm::Loop *L, unsigned Parent, unsigned &Next);
+
+  llvm::MutableArrayRef<llvm::Loop *> Loops;
+  llvm::MutableArrayRef<unsigned> Parents;
+  llvm::MutableArrayRef<uint64_t> Rows;
+  unsigned WordsPerRow = 0;
+  llvm::DenseMap<const llvm::Loop *, unsigned> Numbers;
+  llvm::DenseMap<const llvm::BasicBlock *, unsigned> BlockLoops;
+};
+
+// Result of LoopFeatureAnalysis: the features of each loop of one function.
+// Its per-loop tables all live in one arena that is freed with the result,
+// so computing it costs a few slab allocations instead of several per loop.
+class LoopFeatureInfo {
+public:
+  // Features of L, or null if L is not a loop of this function.
+  const LoopStats *getStats(const llvm::Loop *L) const {
+    unsigned N = Nest.getNumber(L);
+    return N == LoopNestIndex::NoLoop ? nullptr : &Stats[N];
+  }
+  const LoopNestIndex &getNest() const { return Nest; }
+
+  bool invalidate(llvm::Function &F, const llvm::PreservedAnalyses &PA,
+                  llvm::FunctionAnalysisManager::Invalidator &Inv);
+
+private:
+  friend class LoopFeatureAnalysis;
+
+  llvm::BumpPtrAllocator Arena;
+  LoopNestIndex Nest;
+  llvm::MutableArrayRef<LoopStats> Stats;
+};
+
+class LoopFeatureAnalysis
+    : public llvm::AnalysisInfoMixin<LoopFeatureAnalysis> {
+public:
+  using Result = LoopFeatureInfo;
+
+  // Computes the features of every loop in F with one pass over its blocks.
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+  // The same from a LoopInfo of F built outside the analysis manager. It
+  // only reads the IR, so it may run on several functions at once.
+  static Result compute(llvm::Function &F, llvm::LoopInfo &LI);
+
+private:
+  friend llvm::AnalysisInfoMixin<LoopFeatureAnalysis>;
+  static llvm::AnalysisKey Key;
+};
+
+} // namespace loopfeatures
+
+#endif
@@ -0,0 +1,342 @@
+#include "LoopFeatureAnalysis.h"
+#include "LoopFeatureExtractor.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+using namespace llvm;
+using namespace loopfeatures;
+
+// Runs the loop-features pass over a whole corpus in one process, instead of
+// one opt process per module. Each module is parsed into an LLVMContext of
+// its own on a thread pool, and all of them share one FeatureOutput, so the
+// result is a single dataset with the same rows opt would have written.
+//
+// Modules are handed out largest first from one shared queue: a worker that
+// is done takes the largest module nobody has started, so the small ones
+// fill the gaps at the end instead of a large one starting last.
+//
+//   loop-features-driver -j 8 -params 'out=corpus.arrow;format=arrow' src/
+//   loop-features-driver -file-list modules.txt
+
+static cl::list<std::string>
+    Inputs(cl::Positional, cl::desc("<module or directory>..."));
+
+static cl::opt<std::string>
+    FileList("file-list", cl::desc("Read module paths from <file>, one per "
+                                   "line; '#' starts a comment"),
+             cl::value_desc("file"));
+
+static cl::opt<std::string>
+    Params("params",
+           cl::desc("Parameters of the pass, as in loop-features<...>"),
+           cl::value_desc("params"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::desc("Modules processed at once (default: one per hardware "
+                       "thread)"),
+         cl::init(0));
+
+static cl::opt<bool> LazyBitcode(
+    "lazy-bitcode",
+    cl::desc("Read the functions of .bc modules one at a time, dropping each "
+             "after its features are extracted (default: on)"),
+    cl::init(true));
+
+static cl::opt<std::string> BitcodeCache(
+    "bc-cache",
+    cl::desc("Keep a bitcode copy of every .ll module in <dir> and read it "
+             "instead while the .ll file is unchanged"),
+    cl::value_desc("dir"));
+
+static cl::opt<bool>
+    WorkerStats("worker-stats",
+                cl::desc("Print the modules and busy time of each worker"));
+
+static bool isModuleFile(StringRef Path) {
+  StringRef Ext = sys::path::extension(Path);
+  return Ext == ".ll" || Ext == ".bc";
+}
+
+// Whether Path is the -bc-cache directory, whose entries must not be taken
+// for more corpus modules.
+static bool isBitcodeCache(StringRef Path) {
+  return !BitcodeCache.empty() && sys::fs::equivalent(Path, BitcodeCache);
+}
+
+// Adds Path to Paths, or the .ll and .bc files below it if it is a
+// directory. Hidden entries and the bitcode cache are skipped. Directory
+// entries are sorted so the order does not depend on the file system.
+static bool addInput(StringRef Path, std::vector<std::string> &Paths) {
+  if (!sys::fs::is_directory(Path)) {
+    Paths.push_back(Path.str());
+    return true;
+  }
+  std::vector<std::string> Found;
+  std::error_code EC;
+  for (sys::fs::recursive_directory_iterator It(Path, EC), End;
+       It != End && !EC; It.increment(EC)) {
+    StringRef Entry = It->path();
+    bool IsDirectory = sys::fs::is_directory(Entry);
+    if (sys::path::filename(Entry).startswith(".") ||
+        (IsDirectory && isBitcodeCache(Entry))) {
+      if (IsDirectory)
+        It.no_push();
+      continue;
+    }
+    if (!IsDirectory && isModuleFile(Entry))
+      Found.push_back(Entry.str());
+  }
+  if (EC) {
+    errs() << "Error: Could not read directory " << Path << "\n";
+    return false;
+  }
+  llvm::sort(Found);
+  Paths.insert(Paths.end(), Found.begin(), Found.end());
+  return true;
+}
+
+// A module waiting to be extracted. Its cost is estimated by its file size,
+// which grows with the instruction count in both .ll and .bc files; only the
+// order of the estimates matters.
+struct ModuleJob {
+  std::string Path;
+  uint64_t Size = 0;
+};
+
+// What one worker did, for -worker-stats.
+struct WorkerStat {
+  unsigned NumModules = 0;
+  uint64_t Bytes = 0;
+  std::chrono::duration<double> Busy{0};
+};
+
+static bool collectInputs(std::vector<std::string> &Paths) {
+  if (!FileList.empty()) {
+    auto BufOrErr = MemoryBuffer::getFile(FileList, /*IsText=*/true);
+    if (!BufOrErr) {
+      errs() << "Error: Could not open " << FileList << "\n";
+      return false;
+    }
+    for (line_iterator Line(**BufOrErr, /*SkipBlanks=*/true, '#');
+         !Line.is_at_eof(); ++Line)
+      if (!addInput(Line->trim(), Paths))
+        return false;
+  }
+  for (const std::string &Input : Inputs)
+    if (!addInput(Input, Paths))
+      return false;
+  return true;
+}
+
+// The -bc-cache entry for the .ll file at Path with contents Text. The key
+// covers the path as well, because a module without a source_filename line
+// takes its source file name, and with it its ModuleHash, from the path.
+static std::string getCachePath(StringRef Path, StringRef Text) {
+  uint64_t Key = xxHash64(Text) ^ xxHash64(Path);
+  SmallString<128> CachePath(BitcodeCache);
+  sys::path::append(CachePath, formatv("{0:x-16}.bc", Key).str());
+  return std::string(CachePath);
+}
+
+// Writes M to CachePath through a temporary file, so another worker or
+// process never reads a partial entry.
+static void writeCacheEntry(const Module &M, StringRef CachePath) {
+  int FD;
+  SmallString<128> TempPath;
+  if (!sys::fs::createUniqueFile(CachePath + ".%%%%%%.tmp", FD, TempPath)) {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    WriteBitcodeToFile(M, OS);
+    OS.close();
+    if (!OS.has_error() && !sys::fs::rename(TempPath, CachePath))
+      return;
+    OS.clear_error();
+    sys::fs::remove(TempPath);
+  }
+  errs() << "Warning: Could not write " << CachePath << "\n";
+}
+
+// Parses the module at Path into a context of its own and runs the pass on
+// it with a fresh set of analysis managers. Messages are formatted first and
+// printed with one write, so those of concurrent modules do not interleave.
+static bool extractModule(StringRef Path,
+                          const std::shared_ptr<FeatureOutput> &Output) {
+  LLVMContext Ctx;
+  SMDiagnostic Diag;
+  std::string Msg;
+  raw_string_ostream OS(Msg);
+  std::unique_ptr<Module> M;
+  // A lazily read module only has its globals and function signatures in
+  // memory; the pass reads each body when it gets to it. Bodies are only
+  // checked by the bitcode reader then, not by the verifier.
+  bool Lazy = LazyBitcode && sys::path::extension(Path) == ".bc";
+
+  // With -bc-cache, a .ll file is read as text and only parsed if its
+  // bitcode is not in the cache yet. Entries are verified when written.
+  std::unique_ptr<MemoryBuffer> Text;
+  std::string CachePath;
+  if (!BitcodeCache.empty() && sys::path::extension(Path) == ".ll") {
+    if (auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText=*/true))
+      Text = std::move(*BufOrErr);
+    if (Text) {
+      CachePath = getCachePath(Path, Text->getBuffer());
+      if (sys::fs::exists(CachePath)) {
+        SMDiagnostic CacheDiag;
+        Lazy = LazyBitcode;
+        M = Lazy ? getLazyIRFileModule(CachePath, CacheDiag, Ctx)
+                 : parseIRFile(CachePath, CacheDiag, Ctx);
+        if (M) {
+          M->setModuleIdentifier(Path);
+          CachePath.clear();
+        } else {
+          CacheDiag.print("loop-features-driver", OS);
+          OS << "Warning: Ignoring " << CachePath << ", parsing " << Path
+             << " instead\n";
+          errs() << OS.str();
+          Msg.clear();
+          Lazy = false;
+        }
+      }
+    }
+  }
+  if (!M)
+    M = Lazy   ? getLazyIRFileModule(Path, Diag, Ctx)
+        : Text ? parseIR(Text->getMemBufferRef(), Diag, Ctx)
+               : parseIRFile(Path, Diag, Ctx);
+  if (!M) {
+    Diag.print("loop-features-driver", OS);
+    errs() << OS.str();
+    return false;
+  }
+  if (!Lazy && verifyModule(*M, &OS)) {
+    errs() << "Error: " << Path << " is not valid IR\n" << OS.str();
+    return false;
+  }
+  // Written before the pass runs, since a lazily read module loses its
+  // function bodies in the pass.
+  if (!CachePath.empty())
+    writeCacheEntry(*M, CachePath);
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB;
+  FAM.registerPass([] { return LoopFeatureAnalysis(); });
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  addLoopFeatureExtractor(MPM, Output);
+  MPM.run(*M, MAM);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv, "extracts loop features from many modules at once\n");
+
+  std::vector<std::string> Paths;
+  if (!collectInputs(Paths))
+    return 1;
+  if (Paths.empty()) {
+    errs() << "Error: No input modules\n";
+    return 1;
+  }
+  if (!BitcodeCache.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(BitcodeCache)) {
+      errs() << "Error: Could not create " << BitcodeCache << ": "
+             << EC.message() << "\n";
+      return 1;
+    }
+  }
+  auto Output = createFeatureOutput(Params);
+  if (!Output) {
+    logAllUnhandledErrors(Output.takeError(), errs(), "Error: ");
+    return 1;
+  }
+
+  std::vector<ModuleJob> Queue;
+  for (std::string &Path : Paths) {
+    ModuleJob Job{std::move(Path)};
+    // A missing file sorts last and fails when it is parsed.
+    sys::fs::file_size(Job.Path, Job.Size);
+    Queue.push_back(std::move(Job));
+  }
+  llvm::stable_sort(Queue, [](const ModuleJob &A, const ModuleJob &B) {
+    return A.Size > B.Size;
+  });
+
+  // One task per worker, each taking the next module from the sorted list
+  // until it is empty.
+  ThreadPoolStrategy Strategy = hardware_concurrency(Jobs);
+  unsigned NumWorkers = std::min<size_t>(Strategy.compute_thread_count(),
+                                         Queue.size());
+  std::vector<WorkerStat> Stats(NumWorkers);
+  std::atomic<size_t> NextJob{0};
+  std::atomic<unsigned> NumFailed{0};
+  auto Start = std::chrono::steady_clock::now();
+  ThreadPool Pool(Strategy);
+  for (unsigned W = 0; W < NumWorkers; ++W)
+    Pool.async([&, W] {
+      WorkerStat &Stat = Stats[W];
+      for (size_t I; (I = NextJob++) < Queue.size();) {
+        auto JobStart = std::chrono::steady_clock::now();
+        if (!extractModule(Queue[I].Path, *Output))
+          ++NumFailed;
+        Stat.Busy += std::chrono::steady_clock::now() - JobStart;
+        ++Stat.NumModules;
+        Stat.Bytes += Queue[I].Size;
+      }
+    });
+  Pool.wait();
+  std::chrono::duration<double> Wall = std::chrono::steady_clock::now() - Start;
+
+  if (WorkerStats) {
+    double MaxBusy = 0, SumBusy = 0;
+    for (unsigned W = 0; W < NumWorkers; ++W) {
+      const WorkerStat &Stat = Stats[W];
+      errs() << formatv("worker {0}: {1} modules, {2} KiB, busy {3:f3} s\n", W,
+                        Stat.NumModules, Stat.Bytes / 1024,
+                        Stat.Busy.count());
+      MaxBusy = std::max(MaxBusy, Stat.Busy.count());
+      SumBusy += Stat.Busy.count();
+    }
+    // 1.0 means every worker was busy for as long as the busiest one.
+    errs() << formatv("{0} modules on {1} workers in {2:f3} s, balance "
+                      "{3:f2}\n",
+                      Queue.size(), NumWorkers, Wall.count(),
+                      MaxBusy > 0 ? SumBusy / NumWorkers / MaxBusy : 1.0);
+  }
+  // Modules whose function bodies failed to load in the pass, and those
+  // whose rows an output did not take.
+  NumFailed += getNumFailedModules(**Output) + getNumUnwrittenModules(**Output);
+  if (NumFailed) {
+    errs() << "Error: Could not extract features from " << NumFailed
+           << " of " << Paths.size() << " modules\n";
+    return 1;
+  }
+  return 0;
+}
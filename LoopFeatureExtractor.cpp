@@ -1,215 +1,912 @@
+#include "FeatureFile.h"
+#include "FeatureSink.h"
+#include "LoopFeatureAnalysis.h"
+#include "LoopFeatureExtractor.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <atomic>
 #include <fstream>
 #include <memory>
-#include <set>
+#include <mutex>
+#include <optional>
 
 using namespace llvm;
+using namespace loopfeatures;
 
-namespace {
-struct LoopFeatureExtractor : public PassInfoMixin<LoopFeatureExtractor> {
-  static std::ofstream OutFile;
-  static unsigned CodeIDCounter;
+#define DEBUG_TYPE "loop-features"
 
-  static void initializeOutFile() {
-    static bool initialized = false;
-    if (!initialized) {
-      errs() << "Initializing loop_features.csv\n";
-      OutFile.open("loop_features.csv", std::ios::out | std::ios::app);
-      if (!OutFile.is_open()) {
-        errs() << "Error: Could not open loop_features.csv\n";
-        return;
-      }
-      std::ifstream checkFile("loop_features.csv");
-      bool writeHeader = checkFile.peek() == std::ifstream::traits_type::eof();
-      checkFile.close();
-      if (writeHeader) {
-        OutFile << "CodeID,Function,LoopHeader,num_instr,num_phis,num_calls,num_preds,num_succ,"
-                << "ends_with_unreachable,ends_with_return,ends_with_cond_branch,"
-                << "ends_with_branch,num_float_ops,nums_branchs,num_operands,"
-                << "num_memory_ops,num_unique_predicates,trip_count,num_uses,num_blocks_in_lp,loop_depth\n";
-        OutFile.flush();
-      }
-      errs() << "loop_features.csv opened successfully\n";
-      initialized = true;
-    }
+static cl::list<OutputFormat> DefaultFormats(
+    "loop-features-format", cl::CommaSeparated,
+    cl::desc("Output formats of the loop-features pass (default csv)"),
+    cl::values(clEnumValN(OutputFormat::CSV, "csv", "loop_features.csv"),
+               clEnumValN(OutputFormat::Binary, "binary",
+                          "Columnar loop_features.lfb (see FeatureFile.h)"),
+               clEnumValN(OutputFormat::Arrow, "arrow",
+                          "Arrow IPC file (Feather v2) loop_features.arrow"),
+               clEnumValN(OutputFormat::NumPy, "npy",
+                          "int32 matrix loop_features.npy with the key "
+                          "columns in loop_features.index.csv"),
+               clEnumValN(OutputFormat::Stats, "stats",
+                          "Summary of each feature column on stderr")));
+
+static cl::opt<bool> SkipExisting(
+    "loop-features-skip-existing", cl::init(false),
+    cl::desc("Skip modules whose ModuleHash is already in the output"));
+
+static cl::opt<LogLevel> DefaultLogLevel(
+    "loop-features-log-level", cl::init(LogLevel::Warning),
+    cl::desc("Messages the loop-features pass prints to stderr"),
+    cl::values(clEnumValN(LogLevel::Quiet, "quiet", "None"),
+               clEnumValN(LogLevel::Error, "error", "Errors"),
+               clEnumValN(LogLevel::Warning, "warning",
+                          "Errors and warnings"),
+               clEnumValN(LogLevel::Info, "info",
+                          "Also the output files and each module processed")));
+
+static cl::opt<unsigned> WarningLimit(
+    "loop-features-warning-limit", cl::init(10),
+    cl::desc("Occurrences of a per-loop warning printed for each module; "
+             "the rest are counted"));
+
+static cl::opt<bool> EmitOpcodeHistogram(
+    "loop-features-opcode-histogram", cl::init(false),
+    cl::desc("Append an op_<opcode> column per IR opcode with the number of "
+             "such instructions in the loop"));
+
+// Groups of feature columns that can be selected with the features=
+// parameter. The key columns (CodeID, ModuleHash, Function, LoopHeader) are
+// always written.
+enum FeatureGroup : unsigned {
+  BasicFeatures = 1 << 0,     // Whole-loop counts, trip count and depth.
+  ExclusiveFeatures = 1 << 1, // excl_* counts of the loop's own blocks.
+  OpcodeFeatures = 1 << 2,    // op_<opcode> histogram.
+};
+
+// Settings of one loop-features pass instance. They default to the
+// -loop-features-* options and can be given per instance as pass
+// parameters, e.g. loop-features<out=w0/features.lfb;format=binary>.
+struct LoopFeatureOptions {
+  std::vector<SinkOptions> Sinks;
+  unsigned Features;
+  LogLevel Verbosity;
+  unsigned Threads;
+};
+
+static const char *getDefaultOutPath(OutputFormat Format) {
+  switch (Format) {
+  case OutputFormat::CSV:
+    return "loop_features.csv";
+  case OutputFormat::Binary:
+    return "loop_features.lfb";
+  case OutputFormat::Arrow:
+    return "loop_features.arrow";
+  case OutputFormat::NumPy:
+    return "loop_features.npy";
+  case OutputFormat::Stats:
+    return "";
   }
+  llvm_unreachable("unknown output format");
+}
 
-  static void initializeCodeIDCounter() {
-    std::ifstream idFile("code_id.txt");
-    if (idFile.is_open()) {
-      idFile >> CodeIDCounter;
-      idFile.close();
-      errs() << "Read CodeIDCounter: " << CodeIDCounter << " from code_id.txt\n";
+static LoopFeatureOptions getDefaultOptions() {
+  LoopFeatureOptions Opts;
+  for (OutputFormat Format : DefaultFormats)
+    Opts.Sinks.push_back({Format, getDefaultOutPath(Format)});
+  if (Opts.Sinks.empty())
+    Opts.Sinks.push_back({OutputFormat::CSV, getDefaultOutPath(OutputFormat::CSV)});
+  Opts.Features = BasicFeatures | ExclusiveFeatures;
+  if (EmitOpcodeHistogram)
+    Opts.Features |= OpcodeFeatures;
+  Opts.Verbosity = DefaultLogLevel;
+  Opts.Threads = 1;
+  return Opts;
+}
+
+static Error invalidParameter(StringRef Param) {
+  return createStringError(inconvertibleErrorCode(),
+                           "invalid loop-features parameter '" + Param + "'");
+}
+
+static std::optional<OutputFormat> parseOutputFormat(StringRef Name) {
+  return StringSwitch<std::optional<OutputFormat>>(Name)
+      .Case("csv", OutputFormat::CSV)
+      .Case("binary", OutputFormat::Binary)
+      .Case("arrow", OutputFormat::Arrow)
+      .Case("npy", OutputFormat::NumPy)
+      .Case("stats", OutputFormat::Stats)
+      .Default(std::nullopt);
+}
+
+// Parses the parameters of loop-features<...> the way PassBuilder parses
+// those of its own passes: ';'-separated name=value pairs.
+// Parameters that are not given keep their -loop-features-* defaults; the
+// output path defaults to the format's file in the working directory.
+//
+// out= and format= describe a single output. Several outputs are given
+// instead as one sink=<format>[:<path>] each, and all of them are written
+// from the same extraction.
+static Expected<LoopFeatureOptions> parseLoopFeatureOptions(StringRef Params) {
+  LoopFeatureOptions Opts = getDefaultOptions();
+  std::optional<OutputFormat> Format;
+  std::optional<std::string> OutPath;
+  std::vector<SinkOptions> Sinks;
+  while (!Params.empty()) {
+    StringRef Param, Value;
+    std::tie(Param, Params) = Params.split(';');
+    if ((Value = Param).consume_front("out=")) {
+      if (Value.empty() || !Sinks.empty() ||
+          (isStreamPath(Value) && getStreamFD(Value) < 0))
+        return invalidParameter(Param);
+      OutPath = Value.str();
+    } else if ((Value = Param).consume_front("format=")) {
+      Format = parseOutputFormat(Value);
+      if (!Format || !Sinks.empty())
+        return invalidParameter(Param);
+    } else if ((Value = Param).consume_front("sink=")) {
+      StringRef Name, Path;
+      std::tie(Name, Path) = Value.split(':');
+      std::optional<OutputFormat> SinkFormat = parseOutputFormat(Name);
+      if (!SinkFormat || Format || OutPath ||
+          (isStreamPath(Path) && getStreamFD(Path) < 0) ||
+          (*SinkFormat == OutputFormat::NumPy && isStreamPath(Path)))
+        return invalidParameter(Param);
+      if (Path.empty())
+        Path = getDefaultOutPath(*SinkFormat);
+      Sinks.push_back({*SinkFormat, Path.str()});
+    } else if ((Value = Param).consume_front("features=")) {
+      // '|'-separated, since ',' would end the pass in the pipeline text.
+      SmallVector<StringRef, 4> Groups;
+      Value.split(Groups, '|');
+      Opts.Features = 0;
+      for (StringRef Group : Groups) {
+        unsigned Bit = StringSwitch<unsigned>(Group)
+                           .Case("basic", BasicFeatures)
+                           .Case("exclusive", ExclusiveFeatures)
+                           .Case("opcodes", OpcodeFeatures)
+                           .Default(0);
+        if (!Bit)
+          return invalidParameter(Param);
+        Opts.Features |= Bit;
+      }
+    } else if ((Value = Param).consume_front("log-level=")) {
+      auto Level = StringSwitch<std::optional<LogLevel>>(Value)
+                       .Case("quiet", LogLevel::Quiet)
+                       .Case("error", LogLevel::Error)
+                       .Case("warning", LogLevel::Warning)
+                       .Case("info", LogLevel::Info)
+                       .Default(std::nullopt);
+      if (!Level)
+        return invalidParameter(Param);
+      Opts.Verbosity = *Level;
+    } else if ((Value = Param).consume_front("threads=")) {
+      if (Value.getAsInteger(10, Opts.Threads) || Opts.Threads == 0)
+        return invalidParameter(Param);
     } else {
-      CodeIDCounter = 0;
-      errs() << "No code_id.txt found, initialized CodeIDCounter to 0\n";
+      return invalidParameter(Param);
     }
   }
+  if (!Sinks.empty()) {
+    Opts.Sinks = std::move(Sinks);
+  } else if (Format || OutPath) {
+    if (!Format)
+      Format = Opts.Sinks.front().Format;
+    Opts.Sinks = {{*Format, OutPath ? *OutPath : getDefaultOutPath(*Format)}};
+    // The npy header holds the row count and is rewritten after every
+    // module, which a stream cannot do.
+    if (*Format == OutputFormat::NumPy && isStreamPath(Opts.Sinks[0].Path))
+      return createStringError(inconvertibleErrorCode(),
+                               "npy output cannot be streamed to " +
+                                   Opts.Sinks[0].Path);
+  }
+  return Opts;
+}
 
-  static void saveCodeIDCounter() {
-    std::ofstream idFile("code_id.txt");
-    if (idFile.is_open()) {
-      idFile << CodeIDCounter;
-      idFile.close();
-      errs() << "Saved CodeIDCounter: " << CodeIDCounter << " to code_id.txt\n";
-    } else {
-      errs() << "Error: Could not save CodeIDCounter to code_id.txt\n";
-    }
+namespace {
+// A warning that may fire for every loop. Only the first WarningLimit
+// occurrences in a module are printed; finishModule() reports how many more
+// there were.
+class RateLimitedWarning {
+public:
+  RateLimitedWarning(const char *Summary, LogLevel Verbosity)
+      : Summary(Summary), Verbosity(Verbosity) {}
+
+  // Stream to print one occurrence to, after the "Warning: " prefix.
+  raw_ostream &report() {
+    if (Count++ >= WarningLimit)
+      return nulls();
+    return logStream(Verbosity, LogLevel::Warning) << "Warning: ";
   }
 
-  LoopFeatureExtractor() {
-    errs() << "Constructing LoopFeatureExtractor\n";
-    initializeOutFile();
-    initializeCodeIDCounter();
+  void finishModule() {
+    if (Count > WarningLimit)
+      logStream(Verbosity, LogLevel::Warning)
+          << "Warning: " << Summary << " for " << Count - WarningLimit
+          << " more loops\n";
+    Count = 0;
   }
 
-  ~LoopFeatureExtractor() {
-    saveCodeIDCounter();
+private:
+  const char *Summary;
+  LogLevel Verbosity;
+  unsigned Count = 0;
+};
+
+// A 64-bit counter kept in a small file that every process maps and bumps
+// with an atomic fetch-add, so concurrent opt runs never hand out the same
+// CodeID and never wait on each other.
+class SharedCounter {
+public:
+  using CounterType = std::atomic<uint64_t>;
+  static_assert(CounterType::is_always_lock_free,
+                "the counter must be lock-free to be shared between processes");
+
+  // Maps the counter in Path, creating it if needed. A new counter starts at
+  // Seed. The file is set up under an exclusive lock, so no process can
+  // take an ID before the seed is stored, and only the first one to get the
+  // lock stores it. If the file cannot be mapped, this process counts on its
+  // own from Seed.
+  bool open(StringRef Path, uint64_t Seed) {
+    Local = Seed;
+    int FD;
+    if (sys::fs::openFileForReadWrite(Path, FD, sys::fs::CD_OpenAlways,
+                                      sys::fs::OF_None))
+      return false;
+    std::error_code EC = sys::fs::lockFile(FD);
+    bool Locked = !EC;
+    sys::fs::file_status Status;
+    if (!EC)
+      EC = sys::fs::status(FD, Status);
+    bool Created = !EC && Status.getSize() < sizeof(CounterType);
+    if (Created)
+      EC = sys::fs::resize_file(FD, sizeof(CounterType));
+    if (!EC)
+      Region = std::make_unique<sys::fs::mapped_file_region>(
+          sys::fs::convertFDToNativeFile(FD),
+          sys::fs::mapped_file_region::readwrite, sizeof(CounterType), 0, EC);
+    if (!EC && Created)
+      counter().store(Seed);
+    if (Locked)
+      sys::fs::unlockFile(FD);
+    sys::fs::file_t File = sys::fs::convertFDToNativeFile(FD);
+    sys::fs::closeFile(File);
+    if (EC) {
+      Region.reset();
+      return false;
+    }
+    return true;
   }
 
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
-    static unsigned CurrentCodeID = CodeIDCounter++;
-    errs() << "Running LoopFeatureExtractor on module with CodeID: " << CurrentCodeID << "\n";
+  // Safe to call from several threads, e.g. the workers of
+  // loop-features-driver.
+  uint64_t next() { return Region ? counter().fetch_add(1) : Local++; }
 
-    for (Function &F : M) {
-      if (F.isDeclaration()) {
-        errs() << "Skipping function " << F.getName() << " because it is a declaration\n";
+private:
+  CounterType &counter() {
+    return *reinterpret_cast<CounterType *>(Region->data());
+  }
+
+  std::unique_ptr<sys::fs::mapped_file_region> Region;
+  // Used when the file could not be mapped.
+  std::atomic<uint64_t> Local{0};
+};
+
+// Output columns in order, one table per group; the CSV header and the
+// binary schema both come from these tables and LoopFeatureRow::serialize
+// must follow them. CodeID, ModuleHash, Function and LoopHeader identify a
+// row; the remaining columns are the numeric features.
+static const ColumnDesc KeyColumns[] = {
+    {"CodeID", ColumnType::Int32},
+    {"ModuleHash", ColumnType::Int64},
+    {"Function", ColumnType::String},
+    {"LoopHeader", ColumnType::String},
+};
+
+static const unsigned NumKeyColumns = std::size(KeyColumns);
+static const unsigned CodeIDColumn = 0;
+static const unsigned ModuleHashColumn = 1;
+
+static const ColumnDesc BasicColumns[] = {
+    {"num_instr", ColumnType::Int32},
+    {"num_phis", ColumnType::Int32},
+    {"num_calls", ColumnType::Int32},
+    {"num_preds", ColumnType::Int32},
+    {"num_succ", ColumnType::Int32},
+    {"ends_with_unreachable", ColumnType::Int32},
+    {"ends_with_return", ColumnType::Int32},
+    {"ends_with_cond_branch", ColumnType::Int32},
+    {"ends_with_branch", ColumnType::Int32},
+    {"num_float_ops", ColumnType::Int32},
+    {"nums_branchs", ColumnType::Int32},
+    {"num_operands", ColumnType::Int32},
+    {"num_memory_ops", ColumnType::Int32},
+    {"num_unique_predicates", ColumnType::Int32},
+    {"trip_count", ColumnType::Int64},
+    {"num_uses", ColumnType::Int32},
+    {"num_blocks_in_lp", ColumnType::Int32},
+    {"loop_depth", ColumnType::Int32},
+};
+
+static const ColumnDesc ExclusiveColumns[] = {
+    {"excl_num_instr", ColumnType::Int32},
+    {"excl_num_phis", ColumnType::Int32},
+    {"excl_num_calls", ColumnType::Int32},
+    {"excl_num_float_ops", ColumnType::Int32},
+    {"excl_nums_branchs", ColumnType::Int32},
+    {"excl_num_operands", ColumnType::Int32},
+    {"excl_num_memory_ops", ColumnType::Int32},
+    {"excl_num_blocks_in_lp", ColumnType::Int32},
+};
+
+// Columns of an output with the given FeatureGroups: the key columns, then
+// each selected group, the opcode histogram as one op_<opcode> column per
+// opcode.
+static std::vector<ColumnDesc> getOutputColumns(unsigned Features) {
+  static const std::vector<std::string> OpcodeNames = [] {
+    std::vector<std::string> Names;
+    for (unsigned Op = 0; Op < NumOpcodes; ++Op)
+      if (isHistogramOpcode(Op))
+        Names.push_back(std::string("op_") + Instruction::getOpcodeName(Op));
+    return Names;
+  }();
+  std::vector<ColumnDesc> Columns(std::begin(KeyColumns), std::end(KeyColumns));
+  if (Features & BasicFeatures)
+    Columns.insert(Columns.end(), std::begin(BasicColumns),
+                   std::end(BasicColumns));
+  if (Features & ExclusiveFeatures)
+    Columns.insert(Columns.end(), std::begin(ExclusiveColumns),
+                   std::end(ExclusiveColumns));
+  if (Features & OpcodeFeatures)
+    for (const std::string &Name : OpcodeNames)
+      Columns.push_back({Name.c_str(), ColumnType::Int32});
+  return Columns;
+}
+
+// Identifies a module by its content rather than by the order it was
+// processed in: the source file name, the global initializers with their
+// types and the shape of every function (names, block structure, opcodes,
+// operand counts and types, cmp predicates and constant operands), so
+// builds that only differ in loop bounds or dataset sizes get different
+// hashes. The same input always gets the same hash, on any machine and in
+// any order.
+// Functions are added one at a time, so a module whose bodies are read and
+// dropped one by one hashes the same as one that is fully in memory. The
+// words of each function are hashed as soon as it is added, so only one
+// word per function is kept until getHash().
+class ModuleHasher {
+public:
+  explicit ModuleHasher(const Module &M) {
+    Scratch.push_back(xxHash64(M.getSourceFileName()));
+    // Initializers are read with the module, before any function body.
+    for (const GlobalVariable &GV : M.globals()) {
+      if (!GV.hasInitializer())
         continue;
+      Scratch.push_back(xxHash64(GV.getName()));
+      addConstant(GV.getInitializer());
+    }
+    flushScratch();
+  }
+
+  void addFunction(const Function &F) {
+    if (F.isDeclaration())
+      return;
+    Scratch.push_back(xxHash64(F.getName()));
+    Scratch.push_back(F.arg_size());
+    for (const BasicBlock &BB : F) {
+      Scratch.push_back(BB.size());
+      for (const Instruction &I : BB) {
+        Scratch.push_back(I.getOpcode());
+        Scratch.push_back(I.getNumOperands());
+        Scratch.push_back(I.getType()->getTypeID());
+        if (auto *Cmp = dyn_cast<CmpInst>(&I))
+          Scratch.push_back(Cmp->getPredicate());
+        for (const Value *Op : I.operands())
+          if (isa<ConstantInt>(Op) || isa<ConstantFP>(Op))
+            addConstant(cast<Constant>(Op));
       }
+    }
+    flushScratch();
+  }
 
-      errs() << "Analyzing function: " << F.getName() << "\n";
-      auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
-      auto &LI = FAM.getResult<LoopAnalysis>(F);
-      auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  uint64_t getHash() const { return hashWords(Words); }
 
-      size_t loopCount = 0;
-      for (const Loop *L : LI) {
-        ++loopCount;
-      }
-      errs() << "Number of loops detected in " << F.getName() << ": " << loopCount << "\n";
-      if (loopCount == 0) {
-        errs() << "No loops found in function: " << F.getName() << "\n";
-      }
+private:
+  static uint64_t hashWords(ArrayRef<uint64_t> W) {
+    return xxHash64(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(W.data()),
+                                      W.size() * sizeof(uint64_t)));
+  }
+
+  // Replaces the words of the module header or of one function by their
+  // hash.
+  void flushScratch() {
+    Words.push_back(hashWords(Scratch));
+    Scratch.clear();
+  }
+
+  void addAPInt(const APInt &V) {
+    Scratch.push_back(V.getBitWidth());
+    Scratch.append(V.getRawData(), V.getRawData() + V.getNumWords());
+  }
+
+  // The shape of Ty: its kind, integer widths and the element counts of
+  // arrays, vectors and structs, so zeroinitializers of different sizes
+  // differ. Pointers only add their kind.
+  void addType(Type *Ty) {
+    Scratch.push_back(Ty->getTypeID());
+    if (auto *IT = dyn_cast<IntegerType>(Ty)) {
+      Scratch.push_back(IT->getBitWidth());
+    } else if (auto *AT = dyn_cast<ArrayType>(Ty)) {
+      Scratch.push_back(AT->getNumElements());
+      addType(AT->getElementType());
+    } else if (auto *VT = dyn_cast<VectorType>(Ty)) {
+      Scratch.push_back(VT->getElementCount().getKnownMinValue());
+      addType(VT->getElementType());
+    } else if (auto *ST = dyn_cast<StructType>(Ty)) {
+      Scratch.push_back(ST->getNumElements());
+      for (Type *Elt : ST->elements())
+        addType(Elt);
+    }
+  }
+
+  // The kind, type and value of C. Globals it refers to only add their
+  // names.
+  void addConstant(const Constant *C) {
+    Scratch.push_back(C->getValueID());
+    addType(C->getType());
+    if (auto *CI = dyn_cast<ConstantInt>(C))
+      return addAPInt(CI->getValue());
+    if (auto *CF = dyn_cast<ConstantFP>(C))
+      return addAPInt(CF->getValueAPF().bitcastToAPInt());
+    if (auto *CDS = dyn_cast<ConstantDataSequential>(C)) {
+      Scratch.push_back(xxHash64(CDS->getRawDataValues()));
+      return;
+    }
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      Scratch.push_back(xxHash64(GV->getName()));
+      return;
+    }
+    if (auto *CE = dyn_cast<ConstantExpr>(C)) {
+      Scratch.push_back(CE->getOpcode());
+      if (CE->isCompare())
+        Scratch.push_back(CE->getPredicate());
+    }
+    Scratch.push_back(C->getNumOperands());
+    for (const Value *Op : C->operands())
+      addConstant(cast<Constant>(Op));
+  }
+
+  // The words of what is being added, hashed into Words when it is complete.
+  SmallVector<uint64_t, 1024> Scratch;
+  // One word for the module header and one per function.
+  SmallVector<uint64_t, 64> Words;
+};
 
-      for (Loop *L : LI) {
-        errs() << "Analyzing loop with header: " << L->getHeader()->getName() << " in " << F.getName() << "\n";
-        analyzeLoop(L, SE, F.getName(), CurrentCodeID);
+static uint64_t computeModuleHash(const Module &M) {
+  ModuleHasher Hasher(M);
+  for (const Function &F : M)
+    Hasher.addFunction(F);
+  return Hasher.getHash();
+}
+
+struct LoopFeatureRow {
+  unsigned CodeID;
+  uint64_t ModuleHash;
+  StringRef Function;
+  StringRef LoopHeader;
+  const LoopStats &Stats;
+  int64_t trip_count;
+  unsigned loop_depth;
+
+  // Writes the key columns and the columns of the FeatureGroups in Features.
+  template <typename RowWriter>
+  RowWriter &serialize(RowWriter &W, unsigned Features) const {
+    const LoopBodyCounts &Incl = Stats.Inclusive;
+    const LoopBodyCounts &Excl = Stats.Exclusive;
+    W.field(CodeID)
+        .field(static_cast<int64_t>(ModuleHash))
+        .field(Function)
+        .field(LoopHeader);
+    if (Features & BasicFeatures)
+      W.field(Incl.num_instr())
+          .field(Incl.num_phis())
+          .field(Incl.num_calls())
+          .field(Stats.num_preds)
+          .field(Stats.num_succ)
+          .field(Incl.ends_with_unreachable ? 1 : 0)
+          .field(Incl.ends_with_return ? 1 : 0)
+          .field(Incl.ends_with_cond_branch ? 1 : 0)
+          .field(Incl.ends_with_branch ? 1 : 0)
+          .field(Incl.num_float_ops())
+          .field(Incl.nums_branchs())
+          .field(Incl.num_operands)
+          .field(Incl.num_memory_ops())
+          .field(Stats.num_preds)
+          .field(trip_count)
+          .field(Stats.num_uses)
+          .field(Incl.num_blocks_in_lp)
+          .field(loop_depth);
+    if (Features & ExclusiveFeatures)
+      W.field(Excl.num_instr())
+          .field(Excl.num_phis())
+          .field(Excl.num_calls())
+          .field(Excl.num_float_ops())
+          .field(Excl.nums_branchs())
+          .field(Excl.num_operands)
+          .field(Excl.num_memory_ops())
+          .field(Excl.num_blocks_in_lp);
+    if (Features & OpcodeFeatures)
+      for (unsigned Op = 0; Op < NumOpcodes; ++Op)
+        if (isHistogramOpcode(Op))
+          W.field(Incl.Opcodes[Op]);
+    return W;
+  }
+};
+} // namespace
+
+// The sinks of one pass configuration. Sinks are not thread-safe and the
+// advisory lock RecordBatchWriter takes only excludes other processes, so
+// passes sharing an output take its mutex to read it or commit a module.
+class loopfeatures::FeatureOutput {
+public:
+  explicit FeatureOutput(LoopFeatureOptions Opts)
+      : Opts(std::move(Opts)), Columns(getOutputColumns(this->Opts.Features)) {
+    for (const SinkOptions &SinkOpts : this->Opts.Sinks)
+      Sinks.push_back(createFeatureSink(SinkOpts, Columns, NumKeyColumns,
+                                        this->Opts.Verbosity));
+  }
+
+  const LoopFeatureOptions &getOptions() const { return Opts; }
+  ArrayRef<ColumnDesc> getColumns() const { return Columns; }
+
+  // Whether the module with ModuleHash is already in the output: some sink
+  // has its rows and none lacks them.
+  bool isKnownModule(uint64_t ModuleHash) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    bool Known = false;
+    for (auto &Sink : Sinks) {
+      if (std::optional<bool> Contains = Sink->containsModule(ModuleHash)) {
+        if (!*Contains)
+          return false;
+        Known = true;
       }
     }
+    return Known;
+  }
 
-    return PreservedAnalyses::all();
+  // Gives the rows of one module to every sink. A module some sink could
+  // not write is counted as unwritten.
+  void write(const FeatureChunkBuilder &Batch) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    bool Written = true;
+    for (auto &Sink : Sinks)
+      Written &= Sink->write(Batch);
+    if (!Written)
+      ++NumUnwrittenModules;
   }
 
-  void analyzeLoop(Loop *L, ScalarEvolution &SE, StringRef FuncName, unsigned CurrentCodeID) {
-    errs() << "Processing loop in " << FuncName << ", header: " << L->getHeader()->getName() << "\n";
-    std::set<BasicBlock *> LoopBlocks(L->block_begin(), L->block_end());
-    std::set<BasicBlock *> unique_preds;
-    std::set<BasicBlock *> unique_succs;
+  // Counts a module that could not be read completely; none of its rows
+  // are written.
+  void addFailedModule() { ++NumFailedModules; }
+  unsigned getNumFailedModules() const { return NumFailedModules; }
+  unsigned getNumUnwrittenModules() const { return NumUnwrittenModules; }
 
-    int num_instr = 0, num_phis = 0, num_calls = 0;
-    int num_float_ops = 0, nums_branchs = 0, num_operands = 0, num_memory_ops = 0;
-    int num_uses = 0, num_blocks_in_lp = 0, num_unique_predicates = 0;
-    bool ends_with_unreachable = false, ends_with_return = false;
-    bool ends_with_cond_branch = false, ends_with_branch = false;
+private:
+  LoopFeatureOptions Opts;
+  std::vector<ColumnDesc> Columns;
+  std::vector<std::unique_ptr<FeatureSink>> Sinks;
+  std::mutex Mutex;
+  std::atomic<unsigned> NumFailedModules{0};
+  std::atomic<unsigned> NumUnwrittenModules{0};
+};
 
-    for (auto *BB : L->blocks()) {
-      num_blocks_in_lp++;
+namespace {
+struct LoopFeatureExtractor : public PassInfoMixin<LoopFeatureExtractor> {
+  // Shared by every instance, so CodeIDs stay unique across pass instances
+  // and processes.
+  static SharedCounter CodeIDCounter;
 
-      for (Instruction &I : *BB) {
-        num_instr++;
-        num_operands += I.getNumOperands();
+  struct State {
+    std::shared_ptr<FeatureOutput> Output;
+    const LoopFeatureOptions &Opts = Output->getOptions();
+    // Features of the module being processed, one column per output column.
+    // The output is given it when the module is committed.
+    FeatureChunkBuilder Table{Output->getColumns()};
+    RateLimitedWarning TripCountWarning{"trip count not constant",
+                                        Opts.Verbosity};
+    // Created by the first module extracted with threads=N.
+    std::unique_ptr<ThreadPool> Pool;
+    explicit State(std::shared_ptr<FeatureOutput> Output)
+        : Output(std::move(Output)) {}
+  };
+  // Held by pointer so the pass can be moved into the pass manager.
+  std::unique_ptr<State> S;
 
-        if (isa<PHINode>(I)) num_phis++;
-        if (isa<CallBase>(I)) num_calls++;
-        if (isa<LoadInst>(I) || isa<StoreInst>(I)) num_memory_ops++;
-        if (isa<BranchInst>(I)) {
-          nums_branchs++;
-          if (cast<BranchInst>(&I)->isConditional()) ends_with_cond_branch = true;
-          ends_with_branch = true;
-        }
-        if (I.getOpcode() == Instruction::FAdd || I.getOpcode() == Instruction::FSub ||
-            I.getOpcode() == Instruction::FMul || I.getOpcode() == Instruction::FDiv) {
-          num_float_ops++;
+  // Runs once per process, by whichever pass takes the first CodeID.
+  static void initializeCodeIDCounter(LogLevel Verbosity) {
+    static const bool Initialized = [Verbosity] {
+      // Datasets started with the old code_id.txt counter continue from it.
+      unsigned Seed = 0;
+      std::ifstream idFile("code_id.txt");
+      if (idFile.is_open())
+        idFile >> Seed;
+      if (CodeIDCounter.open("code_id.counter", Seed)) {
+        logStream(Verbosity, LogLevel::Info)
+            << "Mapped CodeID counter code_id.counter\n";
+      } else {
+        logStream(Verbosity, LogLevel::Error)
+            << "Error: Could not map code_id.counter, CodeIDs are only "
+            << "unique within this process\n";
+      }
+      return true;
+    }();
+    (void)Initialized;
+  }
+
+  explicit LoopFeatureExtractor(std::shared_ptr<FeatureOutput> Output)
+      : S(std::make_unique<State>(std::move(Output))) {
+    LLVM_DEBUG(dbgs() << "Constructing LoopFeatureExtractor\n");
+  }
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    if (M.getMaterializer())
+      return runLazy(M, MAM);
+    uint64_t ModuleHash = computeModuleHash(M);
+    if (SkipExisting && S->Output->isKnownModule(ModuleHash)) {
+      logStream(S->Opts.Verbosity, LogLevel::Info)
+          << "Skipping module " << M.getModuleIdentifier()
+          << ", its ModuleHash is already in the output\n";
+      return PreservedAnalyses::all();
+    }
+    logStream(S->Opts.Verbosity, LogLevel::Info)
+        << "Running LoopFeatureExtractor on module " << M.getModuleIdentifier()
+        << "\n";
+    // Taken with the first loop, so modules without loops touch neither the
+    // counter nor the output.
+    std::optional<unsigned> CurrentCodeID;
+
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    if (S->Opts.Threads > 1) {
+      emitModuleParallel(M, FAM, CurrentCodeID, ModuleHash);
+    } else {
+      for (Function &F : M) {
+        if (F.isDeclaration()) {
+          LLVM_DEBUG(dbgs() << "Skipping function " << F.getName() << " because it is a declaration\n");
+          continue;
         }
 
-        for (auto *U : I.users()) {
-          if (Instruction *UserI = dyn_cast<Instruction>(U)) {
-            if (L->contains(UserI->getParent())) num_uses++;
-          }
+        LLVM_DEBUG(dbgs() << "Analyzing function: " << F.getName() << "\n");
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        if (LI.empty()) {
+          LLVM_DEBUG(dbgs() << "No loops found in function: " << F.getName() << "\n");
+          continue;
         }
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &Info = FAM.getResult<LoopFeatureAnalysis>(F);
+        emitFunction(M, F, LI, SE, Info, CurrentCodeID, ModuleHash);
       }
+    }
 
-      if (Instruction *TI = BB->getTerminator()) {
-        if (isa<UnreachableInst>(TI)) ends_with_unreachable = true;
-        if (isa<ReturnInst>(TI)) ends_with_return = true;
+    S->Output->write(S->Table);
+    S->Table.clear();
+    S->TripCountWarning.finishModule();
+    return PreservedAnalyses::all();
+  }
+
+  // A module opened with getLazyIRFileModule, e.g. bitcode read by
+  // loop-features-driver: each function body is read, extracted and deleted
+  // again before the next one, so only one body is in memory at a time. The
+  // ModuleHash is only known once every function has been read, so it is
+  // filled into the rows and checked against the output afterwards, and the
+  // CodeID is only taken if the rows are kept. threads=N is not used, since
+  // reading a body is not thread-safe.
+  PreservedAnalyses runLazy(Module &M, ModuleAnalysisManager &MAM) {
+    logStream(S->Opts.Verbosity, LogLevel::Info)
+        << "Running LoopFeatureExtractor on lazily loaded module "
+        << M.getModuleIdentifier() << "\n";
+    ModuleHasher Hasher(M);
+    // Rows get CodeID 0 until the module is committed.
+    std::optional<unsigned> CurrentCodeID = 0;
+
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    for (Function &F : M) {
+      // Bodies not read yet do not count as declarations.
+      if (F.isDeclaration())
+        continue;
+      bool WasLazy = F.isMaterializable();
+      if (Error E = F.materialize()) {
+        logAllUnhandledErrors(std::move(E),
+                              logStream(S->Opts.Verbosity, LogLevel::Error),
+                              "Error: " + M.getModuleIdentifier() + ": ");
+        S->Output->addFailedModule();
+        S->Table.clear();
+        S->TripCountWarning.finishModule();
+        return PreservedAnalyses::none();
       }
+      Hasher.addFunction(F);
 
-      for (auto *Pred : predecessors(BB)) {
-        unique_preds.insert(Pred);
+      LLVM_DEBUG(dbgs() << "Analyzing function: " << F.getName() << "\n");
+      auto &LI = FAM.getResult<LoopAnalysis>(F);
+      if (!LI.empty()) {
+        auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &Info = FAM.getResult<LoopFeatureAnalysis>(F);
+        emitFunction(M, F, LI, SE, Info, CurrentCodeID, /*ModuleHash=*/0);
+      } else {
+        LLVM_DEBUG(dbgs() << "No loops found in function: " << F.getName() << "\n");
       }
-      for (auto *Succ : successors(BB)) {
-        unique_succs.insert(Succ);
+      if (WasLazy) {
+        FAM.clear(F, F.getName());
+        F.deleteBody();
       }
     }
 
-    num_unique_predicates = unique_preds.size();
-    int num_preds = num_unique_predicates;
-    int num_succ = unique_succs.size();
+    uint64_t ModuleHash = Hasher.getHash();
+    if (SkipExisting && S->Output->isKnownModule(ModuleHash)) {
+      logStream(S->Opts.Verbosity, LogLevel::Info)
+          << "Skipping module " << M.getModuleIdentifier()
+          << ", its ModuleHash is already in the output\n";
+    } else if (S->Table.getNumRows()) {
+      S->Table.setColumn(CodeIDColumn, takeCodeID(M));
+      S->Table.setColumn(ModuleHashColumn, ModuleHash);
+      S->Output->write(S->Table);
+    }
+    S->Table.clear();
+    S->TripCountWarning.finishModule();
+    // The function bodies are gone.
+    return PreservedAnalyses::none();
+  }
+
+  // What a worker thread computes for one function. All of it only reads
+  // the IR. ScalarEvolution and AssumptionCache create constants and value
+  // handles in the shared LLVMContext, so the trip counts are left to the
+  // pass's own thread.
+  struct FunctionLoops {
+    DominatorTree DT;
+    LoopInfo LI;
+    LoopFeatureInfo Info;
+  };
+
+  // threads=N: builds the dominator tree, loops and loop features of the
+  // functions on a thread pool, outside the FunctionAnalysisManager, which
+  // is not thread-safe. The pass's thread takes the results in function
+  // order, computes trip counts and emits the rows, so the output is the
+  // same as a serial run. At most a few functions per thread are analyzed
+  // ahead of it to bound memory.
+  void emitModuleParallel(Module &M, FunctionAnalysisManager &FAM,
+                          std::optional<unsigned> &CurrentCodeID,
+                          uint64_t ModuleHash) {
+    std::vector<Function *> Functions;
+    for (Function &F : M)
+      if (!F.isDeclaration())
+        Functions.push_back(&F);
+    if (!S->Pool)
+      S->Pool = std::make_unique<ThreadPool>(
+          hardware_concurrency(S->Opts.Threads));
+
+    std::vector<std::unique_ptr<FunctionLoops>> Results(Functions.size());
+    std::vector<std::shared_future<void>> Done(Functions.size());
+    auto Submit = [&](size_t I) {
+      Done[I] = S->Pool->async([&Functions, &Results, I] {
+        Function &F = *Functions[I];
+        auto R = std::make_unique<FunctionLoops>();
+        R->DT.recalculate(F);
+        R->LI.analyze(R->DT);
+        if (!R->LI.empty())
+          R->Info = LoopFeatureAnalysis::compute(F, R->LI);
+        Results[I] = std::move(R);
+      });
+    };
+    size_t Ahead = std::min<size_t>(4 * S->Opts.Threads, Functions.size());
+    for (size_t I = 0; I < Ahead; ++I)
+      Submit(I);
+
+    for (size_t I = 0; I < Functions.size(); ++I) {
+      Done[I].wait();
+      if (I + Ahead < Functions.size())
+        Submit(I + Ahead);
+      std::unique_ptr<FunctionLoops> R = std::move(Results[I]);
+      Function &F = *Functions[I];
+      LLVM_DEBUG(dbgs() << "Analyzing function: " << F.getName() << "\n");
+      if (R->LI.empty()) {
+        LLVM_DEBUG(dbgs() << "No loops found in function: " << F.getName() << "\n");
+        continue;
+      }
+      AssumptionCache AC(F);
+      ScalarEvolution SE(F, FAM.getResult<TargetLibraryAnalysis>(F), AC, R->DT,
+                         R->LI);
+      emitFunction(M, F, R->LI, SE, R->Info, CurrentCodeID, ModuleHash);
+    }
+  }
+
+  unsigned takeCodeID(const Module &M) {
+    initializeCodeIDCounter(S->Opts.Verbosity);
+    unsigned CodeID = CodeIDCounter.next();
+    logStream(S->Opts.Verbosity, LogLevel::Info)
+        << "Module " << M.getModuleIdentifier() << " has CodeID " << CodeID
+        << "\n";
+    return CodeID;
+  }
+
+  void emitFunction(Module &M, Function &F, LoopInfo &LI, ScalarEvolution &SE,
+                    const LoopFeatureInfo &Info,
+                    std::optional<unsigned> &CurrentCodeID,
+                    uint64_t ModuleHash) {
+    LLVM_DEBUG(dbgs() << "Number of loops detected in " << F.getName() << ": "
+                      << std::distance(LI.begin(), LI.end()) << "\n");
+    if (!CurrentCodeID)
+      CurrentCodeID = takeCodeID(M);
+    for (Loop *L : LI) {
+      LLVM_DEBUG(dbgs() << "Analyzing loop with header: " << L->getHeader()->getName() << " in " << F.getName() << "\n");
+      emitLoop(L, SE, Info, F.getName(), *CurrentCodeID, ModuleHash);
+    }
+  }
+
+  void emitLoop(Loop *L, ScalarEvolution &SE, const LoopFeatureInfo &Info,
+                StringRef FuncName, unsigned CurrentCodeID,
+                uint64_t ModuleHash) {
+    LLVM_DEBUG(dbgs() << "Processing loop in " << FuncName << ", header: " << L->getHeader()->getName() << "\n");
 
     int64_t trip_count = 0;
     if (auto *TC = SE.getBackedgeTakenCount(L)) {
       if (auto *ConstTC = dyn_cast<SCEVConstant>(TC)) {
         trip_count = ConstTC->getValue()->getZExtValue() + 1;
       } else {
-        errs() << "Trip count not constant for loop in " << FuncName << "\n";
+        S->TripCountWarning.report() << "Trip count not constant for loop " << L->getHeader()->getName() << " in " << FuncName << "\n";
       }
     } else {
-      errs() << "Could not compute trip count for loop in " << FuncName << "\n";
+      S->TripCountWarning.report() << "Could not compute trip count for loop " << L->getHeader()->getName() << " in " << FuncName << "\n";
     }
 
     auto *Header = L->getHeader();
-    OutFile << CurrentCodeID << ","
-            << FuncName.str() << ","
-            << Header->getName().str() << ","
-            << num_instr << ","
-            << num_phis << ","
-            << num_calls << ","
-            << num_preds << ","
-            << num_succ << ","
-            << (ends_with_unreachable ? 1 : 0) << ","
-            << (ends_with_return ? 1 : 0) << ","
-            << (ends_with_cond_branch ? 1 : 0) << ","
-            << (ends_with_branch ? 1 : 0) << ","
-            << num_float_ops << ","
-            << nums_branchs << ","
-            << num_operands << ","
-            << num_memory_ops << ","
-            << num_unique_predicates << ","
-            << trip_count << ","
-            << num_uses << ","
-            << num_blocks_in_lp << ","
-            << L->getLoopDepth()
-            << "\n";
-    OutFile.flush();
+    LoopFeatureRow Features{CurrentCodeID, ModuleHash,  FuncName,
+                            Header->getName(), *Info.getStats(L), trip_count,
+                            L->getLoopDepth()};
+    Features.serialize(S->Table, S->Opts.Features).finish();
 
-    errs() << "Wrote features for loop in " << FuncName << ", header: " << Header->getName() << ", CodeID: " << CurrentCodeID << "\n";
+    LLVM_DEBUG(dbgs() << "Wrote features for loop in " << FuncName << ", header: " << Header->getName() << ", CodeID: " << CurrentCodeID << "\n");
 
     for (Loop *SubLoop : L->getSubLoops()) {
-      errs() << "Found subloop with header: " << SubLoop->getHeader()->getName() << " in " << FuncName << "\n";
-      analyzeLoop(SubLoop, SE, FuncName, CurrentCodeID);
+      LLVM_DEBUG(dbgs() << "Found subloop with header: " << SubLoop->getHeader()->getName() << " in " << FuncName << "\n");
+      emitLoop(SubLoop, SE, Info, FuncName, CurrentCodeID, ModuleHash);
     }
   }
 };
 
-std::ofstream LoopFeatureExtractor::OutFile;
-unsigned LoopFeatureExtractor::CodeIDCounter = 0;
+SharedCounter LoopFeatureExtractor::CodeIDCounter;
+}
+
+Expected<std::shared_ptr<FeatureOutput>>
+loopfeatures::createFeatureOutput(StringRef Params) {
+  auto Opts = parseLoopFeatureOptions(Params);
+  if (!Opts)
+    return Opts.takeError();
+  return std::make_shared<FeatureOutput>(std::move(*Opts));
+}
+
+unsigned loopfeatures::getNumFailedModules(const FeatureOutput &Output) {
+  return Output.getNumFailedModules();
+}
+
+unsigned loopfeatures::getNumUnwrittenModules(const FeatureOutput &Output) {
+  return Output.getNumUnwrittenModules();
+}
+
+void loopfeatures::addLoopFeatureExtractor(
+    ModulePassManager &MPM, std::shared_ptr<FeatureOutput> Output) {
+  MPM.addPass(LoopFeatureExtractor(std::move(Output)));
 }
 
 extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
@@ -217,14 +914,37 @@ llvmGetPassPluginInfo() {
   return {
     LLVM_PLUGIN_API_VERSION, "LoopFeatureExtractor", "v0.1",
     [](PassBuilder &PB) {
+      PB.registerAnalysisRegistrationCallback(
+        [](FunctionAnalysisManager &FAM) {
+          FAM.registerPass([] { return LoopFeatureAnalysis(); });
+        });
       PB.registerPipelineParsingCallback(
-        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
-          if (Name == "loop-features") {
-            MPM.addPass(LoopFeatureExtractor());
+        [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name == "require<loop-features>") {
+            FPM.addPass(RequireAnalysisPass<LoopFeatureAnalysis, Function>());
+            return true;
+          }
+          if (Name == "invalidate<loop-features>") {
+            FPM.addPass(InvalidateAnalysisPass<LoopFeatureAnalysis>());
             return true;
           }
           return false;
         });
+      PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+          // loop-features or loop-features<param;param;...>.
+          if (!Name.consume_front("loop-features"))
+            return false;
+          if (!Name.empty() && !(Name.consume_front("<") && Name.consume_back(">")))
+            return false;
+          auto Output = createFeatureOutput(Name);
+          if (!Output) {
+            logAllUnhandledErrors(Output.takeError(), errs(), "Error: ");
+            return false;
+          }
+          addLoopFeatureExtractor(MPM, std::move(*Output));
+          return true;
+        });
     }};
 }
 /*
@@ -0,0 +1,41 @@
+#ifndef LOOP_FEATURE_EXTRACTOR_H
+#define LOOP_FEATURE_EXTRACTOR_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/Error.h"
+#include <memory>
+
+// The loop-features pass for tools that build their own pipelines, such as
+// loop-features-driver. It is the same pass the plugin registers with opt.
+namespace loopfeatures {
+
+// The outputs described by the parameters of loop-features<...>. Several
+// passes can write to one, including from different threads with a
+// LLVMContext each: every pass collects the rows of its module on its own
+// and the module is committed to the outputs under a lock.
+class FeatureOutput;
+
+// Parses Params as given between the brackets of loop-features<...>. Like
+// the pass, the outputs are only opened once the first rows arrive.
+llvm::Expected<std::shared_ptr<FeatureOutput>>
+createFeatureOutput(llvm::StringRef Params);
+
+// The modules passes writing to Output could not read completely, such as
+// lazily loaded bitcode whose function bodies fail to parse. None of their
+// rows are written.
+unsigned getNumFailedModules(const FeatureOutput &Output);
+
+// The modules whose rows some output of Output did not take, e.g. because
+// it could not be opened or holds other columns. Their rows are lost for
+// that output.
+unsigned getNumUnwrittenModules(const FeatureOutput &Output);
+
+// Adds a loop-features pass that writes to Output. The function analysis
+// manager it runs with must have LoopFeatureAnalysis registered.
+void addLoopFeatureExtractor(llvm::ModulePassManager &MPM,
+                             std::shared_ptr<FeatureOutput> Output);
+
+} // namespace loopfeatures
+
+#endif
@@ -0,0 +1,83 @@
+#include "NpyWriter.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+using namespace llvm;
+
+namespace loopfeatures {
+
+void writeNpyHeader(raw_ostream &OS, uint64_t NumRows, unsigned NumCols) {
+  SmallString<NpyHeaderSize> Dict;
+  raw_svector_ostream(Dict) << "{'descr': '<i4', 'fortran_order': False, "
+                            << "'shape': (" << NumRows << ", " << NumCols
+                            << "), }";
+  // Magic, version 1.0 and the uint16 dictionary length come first; the
+  // dictionary is space padded and ends in a newline.
+  const unsigned Prefix = 10;
+  assert(Prefix + Dict.size() + 1 <= NpyHeaderSize && "npy header too long");
+  Dict.append(NpyHeaderSize - Prefix - Dict.size() - 1, ' ');
+  Dict.push_back('\n');
+
+  OS << "\x93NUMPY";
+  OS.write(1);
+  OS.write(0);
+  support::endian::write<uint16_t>(OS, Dict.size(), support::little);
+  OS << Dict;
+}
+
+bool isNpyHeader(StringRef Header, unsigned NumCols) {
+  StringRef Shape = Header;
+  uint64_t NumRows;
+  if (!Shape.consume_front("\x93NUMPY") || Shape.size() < 4)
+    return false;
+  Shape = Shape.drop_front(4).drop_until([](char C) { return C == '('; });
+  if (!Shape.consume_front("(") || Shape.consumeInteger(10, NumRows))
+    return false;
+  // Everything else has to be exactly what this writer would write.
+  std::string Expected;
+  raw_string_ostream OS(Expected);
+  writeNpyHeader(OS, NumRows, NumCols);
+  return OS.str() == Header;
+}
+
+void writeNpyRows(raw_ostream &OS, const FeatureChunkBuilder &Chunk,
+                  ArrayRef<unsigned> Columns) {
+  support::endian::Writer W(OS, support::little);
+  for (size_t Row = 0; Row < Chunk.getNumRows(); ++Row) {
+    for (unsigned Col : Columns) {
+      int64_t V = Chunk.getValue(Col, Row);
+      V = std::min<int64_t>(V, std::numeric_limits<int32_t>::max());
+      V = std::max<int64_t>(V, std::numeric_limits<int32_t>::min());
+      W.write<int32_t>(V);
+    }
+  }
+}
+
+Error updateNpyHeader(StringRef Path, unsigned NumCols) {
+  uint64_t Size;
+  if (std::error_code EC = sys::fs::file_size(Path, Size))
+    return createFileError(Path, EC);
+  uint64_t NumRows = Size < NpyHeaderSize
+                         ? 0
+                         : (Size - NpyHeaderSize) / (sizeof(int32_t) * NumCols);
+
+  int FD;
+  if (std::error_code EC = sys::fs::openFileForReadWrite(
+          Path, FD, sys::fs::CD_OpenExisting, sys::fs::OF_None))
+    return createFileError(Path, EC);
+  raw_fd_ostream OS(FD, /*shouldClose=*/true);
+  OS.seek(0);
+  writeNpyHeader(OS, NumRows, NumCols);
+  OS.close();
+  if (std::error_code EC = OS.error()) {
+    OS.clear_error();
+    return createFileError(Path, EC);
+  }
+  return Error::success();
+}
+
+} // namespace loopfeatures
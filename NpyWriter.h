@@ -0,0 +1,40 @@
+#ifndef LOOP_FEATURE_NPY_WRITER_H
+#define LOOP_FEATURE_NPY_WRITER_H
+
+#include "FeatureFile.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+
+// NumPy .npy output: the numeric feature columns as one C-order little-endian
+// int32 matrix, so np.load(..., mmap_mode='r') maps the whole dataset.
+//
+// The header is padded to a fixed NpyHeaderSize so its shape can be
+// rewritten in place. Rows are appended first and the header is updated
+// after them, from the file size; until then readers keep seeing the old
+// shape and ignore the trailing rows.
+namespace loopfeatures {
+
+constexpr unsigned NpyHeaderSize = 128;
+
+// Writes the header of an int32 matrix of NumRows x NumCols.
+void writeNpyHeader(llvm::raw_ostream &OS, uint64_t NumRows, unsigned NumCols);
+
+// Whether Header is the header of an int32 matrix with NumCols columns and
+// any number of rows.
+bool isNpyHeader(llvm::StringRef Header, unsigned NumCols);
+
+// Writes every row of Chunk restricted to Columns, row-major. Int64 values
+// saturate to the int32 range.
+void writeNpyRows(llvm::raw_ostream &OS, const FeatureChunkBuilder &Chunk,
+                  llvm::ArrayRef<unsigned> Columns);
+
+// Rewrites the shape in the header of Path to cover every complete row in
+// the file.
+llvm::Error updateNpyHeader(llvm::StringRef Path, unsigned NumCols);
+
+} // namespace loopfeatures
+
+#endif
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Writes a module of large generated loop nests for the pass benchmarks.
+
+Every function is a loop nest of --depth loops. The innermost body is a
+chain of --blocks blocks of --insts instructions, each ending in a
+conditional branch to the next block or the one after it, so blocks have
+several predecessors and successors. Bodies only use the induction variables
+and values of their own block, so the IR uses no pointers and parses with
+LLVM versions on either side of the switch to opaque pointers.
+
+  gen_loop_nests.py --functions 60 --depth 8 --blocks 300 --insts 20 -o nests.ll
+"""
+
+import argparse
+import sys
+
+OPS = ["add", "mul", "xor", "sub", "and", "or", "shl"]
+
+
+def function(name, depth, blocks, insts):
+    out = ["define i32 @%s(i32 %%n) {" % name, "entry:", "  br label %h0"]
+    # Headers, outermost first.
+    for d in range(depth):
+        pred = "entry" if d == 0 else "h%d" % (d - 1)
+        out += ["h%d:" % d,
+                "  %%i%d = phi i32 [0, %%%s], [%%i%d.next, %%latch%d]"
+                % (d, pred, d, d)]
+        out.append("  br label %%%s" % ("h%d" % (d + 1) if d + 1 < depth
+                                        else "b0"))
+    # The innermost body.
+    inner = depth - 1
+    for b in range(blocks):
+        out.append("b%d:" % b)
+        prev = "%%i%d" % (b % depth)
+        for k in range(insts - 2):
+            op = OPS[(b + k) % len(OPS)]
+            rhs = "%%i%d" % ((b + k) % depth) if k % 3 else str(b + k + 1)
+            out.append("  %%v%d.%d = %s i32 %s, %s" % (b, k, op, prev, rhs))
+            prev = "%%v%d.%d" % (b, k)
+        out.append("  %%c%d = icmp slt i32 %s, %%n" % (b, prev))
+        succs = ["b%d" % s if s < blocks else "latch%d" % inner
+                 for s in (b + 1, b + 2)]
+        out.append("  br i1 %%c%d, label %%%s, label %%%s"
+                   % (b, succs[0], succs[1]))
+    # Latches, innermost first, each leaving to the enclosing latch.
+    for d in reversed(range(depth)):
+        exit = "exit" if d == 0 else "latch%d" % (d - 1)
+        out += ["latch%d:" % d,
+                "  %%i%d.next = add i32 %%i%d, 1" % (d, d),
+                "  %%done%d = icmp sge i32 %%i%d.next, %%n" % (d, d),
+                "  br i1 %%done%d, label %%%s, label %%h%d" % (d, exit, d)]
+    out += ["exit:", "  ret i32 %n", "}", ""]
+    return "\n".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--functions", type=int, default=60)
+    parser.add_argument("--depth", type=int, default=8)
+    parser.add_argument("--blocks", type=int, default=300)
+    parser.add_argument("--insts", type=int, default=20)
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    for f in range(args.functions):
+        out.write(function("nest%d" % f, args.depth, args.blocks, args.insts))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Times the loop-features pass on generated loop nests and counts its
+mallocs.
+
+Generates a module with gen_loop_nests.py (60 functions of 8-deep nests
+around 300 blocks of 20 instructions by default) and runs opt on it:
+
+  - with -passes=loop-features and -time-passes, taking the user+system time
+    of LoopFeatureExtractor and LoopFeatureAnalysis, best of --runs;
+  - with malloc_count.so preloaded, once with loop-features and once with a
+    pipeline that only builds LoopInfo and ScalarEvolution, and reporting
+    the difference as the pass's mallocs.
+
+  loop_nest_bench.py --opt <llvm>/bin/opt --plugin build/LoopFeatureExtractorPlugin.so
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PASS_ROWS = ("LoopFeatureExtractor", "LoopFeatureAnalysis")
+BASELINE = "function(require<loops>,require<scalar-evolution>)"
+
+
+def pass_time(opt, plugin, module, work):
+    """User+system seconds of the pass and its analysis in one run."""
+    out = subprocess.run(
+        [opt, "-load-pass-plugin", plugin, "-passes=loop-features",
+         "-time-passes", "-disable-output", module],
+        cwd=work, check=True, stderr=subprocess.PIPE, text=True).stderr
+    total = 0.0
+    for line in out.splitlines():
+        if any(name in line for name in PASS_ROWS):
+            # Columns: user, system, user+system, wall, each as
+            # "seconds (percent)", then the name.
+            times = re.findall(r"(\d+\.\d+) \(", line)
+            if len(times) >= 3:
+                total += float(times[2])
+    return total
+
+
+def malloc_count(opt, plugin, module, passes, shim, work):
+    env = dict(os.environ, LD_PRELOAD=shim)
+    out = subprocess.run(
+        [opt, "-load-pass-plugin", plugin, "-passes=" + passes,
+         "-disable-output", module],
+        cwd=work, env=env, check=True, stderr=subprocess.PIPE,
+        text=True).stderr
+    counts = re.findall(r"malloc-count: (\d+)", out)
+    return int(counts[-1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--opt", required=True)
+    parser.add_argument("--plugin", required=True)
+    parser.add_argument("--runs", type=int, default=7)
+    parser.add_argument("--cc", default="cc")
+    parser.add_argument("gen_args", nargs="*",
+                        help="arguments for gen_loop_nests.py, after --")
+    args = parser.parse_args()
+    plugin = os.path.abspath(args.plugin)
+
+    with tempfile.TemporaryDirectory() as work:
+        module = os.path.join(work, "nests.ll")
+        subprocess.run([sys.executable, os.path.join(HERE, "gen_loop_nests.py"),
+                        "-o", module, *args.gen_args], check=True)
+        # The pass writes loop_features.csv and code_id.counter to the
+        # working directory, which is the temporary one.
+        best = min(pass_time(args.opt, plugin, module, work)
+                   for _ in range(args.runs))
+        print("pass time: %.0f ms (best of %d)" % (best * 1000, args.runs))
+
+        shim = os.path.join(work, "malloc_count.so")
+        subprocess.run([args.cc, "-shared", "-fPIC", "-O2", "-o", shim,
+                        os.path.join(HERE, "malloc_count.c")], check=True)
+        with_pass = malloc_count(args.opt, plugin, module, "loop-features",
+                                 shim, work)
+        baseline = malloc_count(args.opt, plugin, module, BASELINE, shim, work)
+        print("mallocs:   %d (%d with the pass, %d building LoopInfo and "
+              "ScalarEvolution only)" % (with_pass - baseline, with_pass,
+                                        baseline))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,35 @@
+/* Counts calls to malloc, calloc and realloc and prints the total to stderr
+ * when the process exits. Preloaded by loop_nest_bench.py:
+ *
+ *   cc -shared -fPIC -O2 -o malloc_count.so malloc_count.c
+ *   LD_PRELOAD=./malloc_count.so opt ...
+ *
+ * Forwards to glibc's own entry points, so it needs no dlsym. */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t Size);
+extern void *__libc_calloc(size_t Count, size_t Size);
+extern void *__libc_realloc(void *Ptr, size_t Size);
+
+static atomic_ulong NumAllocs;
+
+void *malloc(size_t Size) {
+  atomic_fetch_add_explicit(&NumAllocs, 1, memory_order_relaxed);
+  return __libc_malloc(Size);
+}
+
+void *calloc(size_t Count, size_t Size) {
+  atomic_fetch_add_explicit(&NumAllocs, 1, memory_order_relaxed);
+  return __libc_calloc(Count, Size);
+}
+
+void *realloc(void *Ptr, size_t Size) {
+  atomic_fetch_add_explicit(&NumAllocs, 1, memory_order_relaxed);
+  return __libc_realloc(Ptr, Size);
+}
+
+__attribute__((destructor)) static void report(void) {
+  fprintf(stderr, "malloc-count: %lu\n", atomic_load(&NumAllocs));
+}
@@ -0,0 +1,133 @@
+#include "FeatureFile.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstring>
+
+using namespace llvm;
+using namespace loopfeatures;
+
+// Writes .lfb files with FeatureChunkBuilder and reads them back with
+// FeatureFileReader.
+
+static unsigned NumFailures = 0;
+
+#define CHECK(Cond)                                                            \
+  do {                                                                         \
+    if (!(Cond)) {                                                             \
+      errs() << __FILE__ << ":" << __LINE__ << ": check failed: " #Cond "\n";  \
+      ++NumFailures;                                                           \
+    }                                                                          \
+  } while (false)
+
+static const ColumnDesc Schema[] = {
+    {"CodeID", ColumnType::Int32},
+    {"ModuleHash", ColumnType::Int64},
+    {"Function", ColumnType::String},
+    {"num_instr", ColumnType::Int32},
+};
+
+// A file with two chunks, the first of three rows and the second of one.
+static std::string encodeFile() {
+  std::string Data;
+  raw_string_ostream OS(Data);
+  writeFileHeader(OS, Schema);
+  FeatureChunkBuilder Chunk(Schema);
+  Chunk.field(0).field(-1).field("main").field(12).finish();
+  Chunk.field(0).field(-1).field("kernel_2mm").field(7).finish();
+  Chunk.field(0).field(-1).field("main").field(-5).finish();
+  Chunk.encode(OS);
+  Chunk.clear();
+  Chunk.field(1).field(INT64_MAX).field("").field(3).finish();
+  Chunk.encode(OS);
+  return std::move(OS.str());
+}
+
+static Expected<std::unique_ptr<FeatureFileReader>>
+writeAndOpen(StringRef Data, SmallVectorImpl<char> &Path) {
+  int FD;
+  if (std::error_code EC =
+          sys::fs::createTemporaryFile("feature-file-test", "lfb", FD, Path))
+    return errorCodeToError(EC);
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Data;
+  }
+  return FeatureFileReader::open(StringRef(Path.data(), Path.size()));
+}
+
+static void testRoundTrip() {
+  SmallString<128> Path;
+  auto Reader = writeAndOpen(encodeFile(), Path);
+  if (!Reader) {
+    logAllUnhandledErrors(Reader.takeError(), errs(), "error: ");
+    ++NumFailures;
+    return;
+  }
+  const FeatureFileReader &R = **Reader;
+  CHECK(R.getSchema().size() == std::size(Schema));
+  for (unsigned Col = 0; Col < std::size(Schema); ++Col) {
+    CHECK(StringRef(R.getSchema()[Col].Name) == Schema[Col].Name);
+    CHECK(R.getSchema()[Col].Type == Schema[Col].Type);
+  }
+  CHECK(R.findColumn("num_instr") == 3);
+  CHECK(R.findColumn("trip_count") == -1);
+  CHECK(R.chunks().size() == 2);
+  CHECK(R.getNumRows() == 4);
+  if (R.chunks().size() == 2) {
+    const FeatureChunk &First = R.chunks()[0];
+    CHECK(First.getNumRows() == 3);
+    CHECK(First.getInt64Column(1)[2] == -1);
+    CHECK(First.getString(2, 0) == "main");
+    CHECK(First.getString(2, 1) == "kernel_2mm");
+    CHECK(First.getString(2, 2) == "main");
+    CHECK(First.getStringColumn(2)[0] == First.getStringColumn(2)[2]);
+    CHECK(First.getInt32Column(3)[2] == -5);
+    const FeatureChunk &Second = R.chunks()[1];
+    CHECK(Second.getInt32Column(0)[0] == 1);
+    CHECK(Second.getInt64Column(1)[0] == INT64_MAX);
+    CHECK(Second.getString(2, 0).empty());
+  }
+  sys::fs::remove(Path);
+}
+
+// A string offset past the chunk's string table must be rejected when the
+// file is opened rather than read out of bounds later.
+static void testBadStringOffset() {
+  std::string Data = encodeFile();
+  // The first chunk's Function column follows the 16-byte chunk header and
+  // the two numeric columns, each padded to 8 bytes.
+  size_t ChunkStart = Data.find(StringRef(ChunkMagic, sizeof(ChunkMagic)));
+  CHECK(ChunkStart != std::string::npos);
+  size_t Function = ChunkStart + 16 + 16 + 24;
+  uint32_t Bad = 1000;
+  std::memcpy(&Data[Function + 4], &Bad, sizeof(Bad));
+
+  SmallString<128> Path;
+  auto Reader = writeAndOpen(Data, Path);
+  CHECK(!Reader);
+  if (!Reader)
+    CHECK(StringRef(toString(Reader.takeError())).contains("string offset"));
+  sys::fs::remove(Path);
+}
+
+static void testTruncated() {
+  std::string Data = encodeFile();
+  Data.resize(Data.size() - 8);
+  SmallString<128> Path;
+  auto Reader = writeAndOpen(Data, Path);
+  CHECK(!Reader);
+  if (!Reader)
+    consumeError(Reader.takeError());
+  sys::fs::remove(Path);
+}
+
+int main() {
+  testRoundTrip();
+  testBadStringOffset();
+  testTruncated();
+  if (NumFailures)
+    errs() << NumFailures << " checks failed\n";
+  return NumFailures ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+"""Checks that pyarrow reads the Arrow files and streams the pass writes,
+with the same rows as the CSV output of the same run.
+
+Usage: arrow_roundtrip.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import subprocess
+import sys
+
+import corpus
+
+try:
+    import pyarrow.feather
+    import pyarrow.ipc
+except ImportError:
+    print("pyarrow is not installed, skipping")
+    sys.exit(77)
+
+driver = corpus.start_test()
+corpus.write_corpus("corpus", 6)
+# One row per loop: f<i> has a nest of 1 + i % 3 loops and g<i> one of 2.
+num_loops = sum(1 + i % 3 + 2 for i in range(6))
+
+
+def run(params, *args, **kwargs):
+    return subprocess.run([driver, "-params", params, *args, "corpus"],
+                          check=True, **kwargs)
+
+
+# Two runs append to the same files, so the second one has to extend the
+# first one's footer.
+for _ in range(2):
+    run("sink=csv:f.csv;sink=arrow:f.arrow")
+
+with open("f.csv") as f:
+    rows = list(csv.reader(f))
+header, rows = rows[0], rows[1:]
+assert len(rows) == 2 * num_loops, len(rows)
+
+table = pyarrow.feather.read_table("f.arrow")
+assert table.column_names == header, (table.column_names, header)
+arrow_rows = [[str(v) for v in row.values()] for row in table.to_pylist()]
+assert sorted(arrow_rows) == sorted(rows), "Arrow rows differ from the CSV"
+
+# Each append replaces the footer instead of leaving the old one behind, so
+# the magic is only at the start and the end.
+with open("f.arrow", "rb") as f:
+    assert f.read().count(b"ARROW1") == 2, "stale footers in f.arrow"
+
+# A stream gets the IPC streaming format instead.
+out = run("out=-;format=arrow;log-level=error", stdout=subprocess.PIPE).stdout
+stream = pyarrow.ipc.open_stream(out).read_all()
+assert stream.column_names == header
+assert stream.num_rows == num_loops, stream.num_rows
+
+print("ok: %d rows" % table.num_rows)
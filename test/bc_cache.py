@@ -0,0 +1,47 @@
+"""Runs the driver twice with a bitcode cache inside the corpus, as the
+README suggests, and checks that the second run reads the cache instead of
+parsing the text, extracts every module once, and re-parses a module whose
+text changed.
+
+Usage: bc_cache.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import os
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+paths = corpus.write_corpus("corpus", 6)
+
+
+def run(cache, out):
+    subprocess.run([driver, "-bc-cache", cache, "-params", "out=" + out,
+                    "corpus"], check=True)
+    with open(out) as f:
+        return sorted((r["ModuleHash"], r["Function"], r["LoopHeader"])
+                      for r in csv.DictReader(f))
+
+
+# A hidden cache directory and a visible one given by another path.
+for cache in ["corpus/.bc-cache", "corpus/sub/../cache"]:
+    name = os.path.basename(cache)
+    first = run(cache, name + "-1.csv")
+    entries = sorted(os.listdir(cache))
+    assert len(entries) == len(paths), entries
+    # A miss would write its entry again, through a new file.
+    inodes = [os.stat(os.path.join(cache, e)).st_ino for e in entries]
+    second = run(cache, name + "-2.csv")
+    assert second == first, "second run differs: %d rows, first %d" % (
+        len(second), len(first))
+    assert sorted(os.listdir(cache)) == entries
+    assert inodes == [os.stat(os.path.join(cache, e)).st_ino
+                      for e in entries], "cache entries were rewritten"
+
+# A changed module gets a new entry; the others are reused.
+corpus.write_module(paths[0], [("changed", 5, 1)])
+third = run("corpus/.bc-cache", "changed.csv")
+assert len(os.listdir("corpus/.bc-cache")) == len(paths) + 1
+assert any(row[1] == "changed" for row in third)
+print("ok")
@@ -0,0 +1,46 @@
+"""Starts many driver processes at once in a directory with a legacy
+code_id.txt and checks that every module gets its own CodeID, continuing
+from the seed. A process that cannot map code_id.counter continues from the
+seed on its own.
+
+Usage: codeid_seed.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import os
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+
+SEED = 1000
+NUM_PROCS = 16
+MODULES_PER_PROC = 4
+with open("code_id.txt", "w") as f:
+    f.write("%d\n" % SEED)
+for i in range(NUM_PROCS * MODULES_PER_PROC):
+    corpus.write_module("corpus/p%d/m%d.ll" % (i % NUM_PROCS, i),
+                        [("f%d" % i, 10, 1)])
+
+procs = [subprocess.Popen([driver, "-params", "out=f.csv", "corpus/p%d" % p])
+         for p in range(NUM_PROCS)]
+assert all(p.wait() == 0 for p in procs)
+
+with open("f.csv") as f:
+    ids = sorted(int(row["CodeID"]) for row in csv.DictReader(f))
+expected = list(range(SEED, SEED + NUM_PROCS * MODULES_PER_PROC))
+assert ids == expected, ids
+
+# A directory in place of the counter file cannot be mapped.
+os.makedirs("nomap/code_id.counter")
+os.chdir("nomap")
+with open("code_id.txt", "w") as f:
+    f.write("%d\n" % SEED)
+proc = subprocess.run([driver, "-params", "out=f.csv", "../corpus/p0"],
+                      stderr=subprocess.PIPE, text=True, check=True)
+assert "Could not map code_id.counter" in proc.stderr, proc.stderr
+with open("f.csv") as f:
+    ids = sorted(int(row["CodeID"]) for row in csv.DictReader(f))
+assert ids == list(range(SEED, SEED + MODULES_PER_PROC)), ids
+print("ok")
@@ -0,0 +1,116 @@
+"""Small LLVM IR modules for the driver tests.
+
+The IR uses no pointers, so it parses with LLVM versions on either side of
+the switch to opaque pointers.
+"""
+
+import os
+import shutil
+import sys
+
+
+def start_test():
+    """Starts a test run as `<script> <loop-features-driver> <work dir>`:
+    empties the work directory, makes it the current directory and returns
+    the driver."""
+    driver, work = sys.argv[1], sys.argv[2]
+    shutil.rmtree(work, ignore_errors=True)
+    os.makedirs(work)
+    os.chdir(work)
+    return driver
+
+
+def loop_function(name, bound, depth=1):
+    """A function with a loop nest of the given depth, each loop running
+    `bound` times."""
+    lines = ["define i32 @%s(i32 %%n) {" % name, "entry:", "  br label %l0"]
+    for d in range(depth):
+        pred = "entry" if d == 0 else "l%d" % (d - 1)
+        latch_pred = "l%d" % d if d == depth - 1 else "l%d.latch" % d
+        lines += [
+            "l%d:" % d,
+            "  %%i%d = phi i32 [0, %%%s], [%%i%d.next, %%%s]" % (d, pred, d, latch_pred),
+        ]
+        if d == depth - 1:
+            lines += [
+                "  %%i%d.next = add i32 %%i%d, 1" % (d, d),
+                "  %%c%d = icmp slt i32 %%i%d.next, %d" % (d, d, bound),
+                "  br i1 %%c%d, label %%l%d, label %%%s" % (
+                    d, d, "exit" if d == 0 else "l%d.latch" % (d - 1)),
+            ]
+        else:
+            lines.append("  br label %%l%d" % (d + 1))
+    for d in reversed(range(depth - 1)):
+        lines += [
+            "l%d.latch:" % d,
+            "  %%i%d.next = add i32 %%i%d, 1" % (d, d),
+            "  %%c%d = icmp slt i32 %%i%d.next, %d" % (d, d, bound),
+            "  br i1 %%c%d, label %%l%d, label %%%s" % (
+                d, d, "exit" if d == 0 else "l%d.latch" % (d - 1)),
+        ]
+    lines += ["exit:", "  ret i32 %n", "}", ""]
+    return "\n".join(lines)
+
+
+def deep_nest_function(name, depth):
+    """A function with a chain of `depth` loops whose innermost loop holds two
+    sibling loops, entered from the same block. The second sibling's phi
+    uses a value of the first, and the first uses the outermost counter.
+    Past 64 loops, the loop numbers of the siblings and their parent are
+    in another 64-bit word than those of the outer loops."""
+    last = depth - 1
+    lines = ["define i32 @%s(i32 %%n) {" % name, "entry:", "  br label %l0"]
+    for d in range(depth):
+        pred = "entry" if d == 0 else "l%d" % (d - 1)
+        lines += [
+            "l%d:" % d,
+            "  %%i%d = phi i32 [0, %%%s], [%%i%d.next, %%l%d.latch]" % (
+                d, pred, d, d),
+        ]
+        if d < last:
+            lines.append("  br label %%l%d" % (d + 1))
+    lines += [
+        "  %%c = icmp slt i32 %%i%d, %%n" % last,
+        "  br i1 %c, label %a, label %b",
+        "a:",
+        "  %%ia = phi i32 [0, %%l%d], [%%ia.next, %%a]" % last,
+        "  %ia.next = add i32 %ia, %i0",
+        "  %ca = icmp slt i32 %ia.next, 4",
+        "  br i1 %ca, label %a, label %b",
+        "b:",
+        "  %%ib = phi i32 [0, %%l%d], [%%ia.next, %%a], [%%ib.next, %%b]" % last,
+        "  %ib.next = add i32 %ib, 1",
+        "  %cb = icmp slt i32 %ib.next, 8",
+        "  br i1 %%cb, label %%b, label %%l%d.latch" % last,
+    ]
+    for d in reversed(range(depth)):
+        lines += [
+            "l%d.latch:" % d,
+            "  %%i%d.next = add i32 %%i%d, 1" % (d, d),
+            "  %%cl%d = icmp slt i32 %%i%d.next, 2" % (d, d),
+            "  br i1 %%cl%d, label %%l%d, label %%%s" % (
+                d, d, "exit" if d == 0 else "l%d.latch" % (d - 1)),
+        ]
+    lines += ["exit:", "  ret i32 %n", "}", ""]
+    return "\n".join(lines)
+
+
+def write_module(path, functions):
+    """Writes a module with the (name, bound, depth) functions to path."""
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "w") as f:
+        for name, bound, depth in functions:
+            f.write(loop_function(name, bound, depth))
+
+
+def write_corpus(root, count):
+    """Writes count modules below root, some in a subdirectory, and returns
+    their paths."""
+    paths = []
+    for i in range(count):
+        sub = "sub" if i % 2 else ""
+        path = os.path.join(root, sub, "m%d.ll" % i)
+        write_module(path, [("f%d" % i, 10 + i, 1 + i % 3),
+                            ("g%d" % i, 100, 2)])
+        paths.append(path)
+    return paths
@@ -0,0 +1,132 @@
+; Loops whose features feature_values.py compares with feature_values.csv.
+; Pointers are typed; the test rewrites them as ptr for LLVM versions that
+; only read opaque pointers.
+
+declare double @scale(double)
+declare void @abort()
+
+; Two inner loops of one outer loop, the second using a value of the first.
+define i32 @siblings(i32 %n) {
+entry:
+  br label %outer
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %a
+a:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %a ]
+  %j.next = add i32 %j, 1
+  %ca = icmp slt i32 %j.next, 10
+  br i1 %ca, label %a, label %b.pre
+b.pre:
+  br label %b
+b:
+  %k = phi i32 [ %j.next, %b.pre ], [ %k.next, %b ]
+  %k.next = add i32 %k, %i
+  %cb = icmp slt i32 %k.next, %n
+  br i1 %cb, label %b, label %outer.latch
+outer.latch:
+  %i.next = add i32 %i, 1
+  %co = icmp slt i32 %i.next, 5
+  br i1 %co, label %outer, label %exit
+exit:
+  ret i32 %i.next
+}
+
+; A block of the outer loop branches straight into both inner loops, and
+; both leave through the same latch.
+define i32 @fork(i32 %n) {
+entry:
+  br label %outer
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %c = icmp slt i32 %i, %n
+  br i1 %c, label %left, label %right
+left:
+  %l = phi i32 [ 0, %outer ], [ %l.next, %left ]
+  %l.next = add i32 %l, 1
+  %cl = icmp slt i32 %l.next, 3
+  br i1 %cl, label %left, label %latch
+right:
+  %r = phi i32 [ 0, %outer ], [ %r.next, %right ]
+  %r.next = add i32 %r, 2
+  %cr = icmp slt i32 %r.next, 8
+  br i1 %cr, label %right, label %latch
+latch:
+  %v = phi i32 [ %l.next, %left ], [ %r.next, %right ]
+  %i.next = add i32 %i, %v
+  %co = icmp slt i32 %i.next, 100
+  br i1 %co, label %outer, label %exit
+exit:
+  ret i32 %i.next
+}
+
+; The entry block branches into two top-level loops, which share no loop.
+define i32 @top_fork(i32 %n) {
+entry:
+  %c = icmp sgt i32 %n, 0
+  br i1 %c, label %x, label %y
+x:
+  %xi = phi i32 [ 0, %entry ], [ %xi.next, %x ]
+  %xi.next = add i32 %xi, 1
+  %cx = icmp slt i32 %xi.next, 7
+  br i1 %cx, label %x, label %exit
+y:
+  %yi = phi i32 [ 0, %entry ], [ %yi.next, %y ]
+  %yi.next = add i32 %yi, 1
+  %cy = icmp slt i32 %yi.next, %n
+  br i1 %cy, label %y, label %exit
+exit:
+  %r = phi i32 [ %xi.next, %x ], [ %yi.next, %y ]
+  ret i32 %r
+}
+
+; A loop left early through a return and through a call to abort.
+define i32 @early_exits(i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %neg = icmp slt i32 %n, 0
+  br i1 %neg, label %trap, label %check
+check:
+  %done = icmp eq i32 %i, %n
+  br i1 %done, label %early, label %latch
+latch:
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, 50
+  br i1 %c, label %loop, label %exit
+trap:
+  call void @abort()
+  unreachable
+early:
+  ret i32 %i
+exit:
+  ret i32 -1
+}
+
+; Loads, stores, a call and floating-point arithmetic.
+define void @memory(double* %a, double* %b, i32* %idx) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi double [ 0.0, %entry ], [ %acc.next, %loop ]
+  %pa = getelementptr inbounds double, double* %a, i64 %i
+  %x = load double, double* %pa
+  %y = call double @scale(double %x)
+  %z = fmul double %y, 2.0
+  %w = fadd double %z, %acc
+  %acc.next = fsub double %w, 1.0
+  %q = fdiv double %acc.next, 3.0
+  %pb = getelementptr inbounds double, double* %b, i64 %i
+  store double %q, double* %pb
+  %pi = getelementptr inbounds i32, i32* %idx, i64 %i
+  %k = load i32, i32* %pi
+  %k1 = add i32 %k, 1
+  store i32 %k1, i32* %pi
+  %i.next = add nuw nsw i64 %i, 1
+  %c = icmp ult i64 %i.next, 64
+  br i1 %c, label %loop, label %exit
+exit:
+  ret void
+}
@@ -0,0 +1,52 @@
+"""Compares the features extracted from feature_values.ll and a 66-deep loop
+nest with feature_values.csv, serially, with threads=4 and from lazily read
+bitcode. The expected rows match the original plugin on every column it
+wrote; CodeID and ModuleHash are not compared.
+
+Usage: feature_values.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import os
+import re
+import subprocess
+
+import corpus
+
+source = os.path.dirname(os.path.abspath(__file__))
+driver = corpus.start_test()
+
+with open(os.path.join(source, "feature_values.ll")) as f:
+    text = f.read()
+# LLVM 15 and later read pointers as ptr.
+if int(os.environ.get("LLVM_VERSION_MAJOR", "14")) >= 15:
+    text = re.sub(r"\b(i32|double)\*", "ptr", text)
+os.makedirs("corpus")
+with open("corpus/feature_values.ll", "w") as f:
+    f.write(text)
+with open("corpus/deep.ll", "w") as f:
+    f.write(corpus.deep_nest_function("deep", 66))
+modules = ["corpus/feature_values.ll", "corpus/deep.ll"]
+
+with open(os.path.join(source, "feature_values.csv")) as f:
+    expected = list(csv.DictReader(f))
+
+
+def extract(out, params, *args):
+    """Runs the driver on one module at a time, so the rows keep the order
+    of `modules`, and returns them."""
+    for module in modules:
+        subprocess.run([driver, "-loop-features-log-level=error", *args,
+                        "-params", "out=%s;%s" % (out, params), module],
+                       check=True)
+    with open(out) as f:
+        return [{k: row[k] for k in expected[0]} for row in csv.DictReader(f)]
+
+
+assert extract("serial.csv", "threads=1") == expected
+assert extract("parallel.csv", "threads=4") == expected
+# The first run with the cache parses the text and writes the bitcode the
+# second one reads lazily.
+extract("cached.csv", "threads=1", "-bc-cache", "cache")
+assert extract("lazy.csv", "threads=1", "-bc-cache", "cache") == expected
+print("ok")
@@ -0,0 +1,48 @@
+"""Corrupts copies of a bitcode module and checks that the driver fails on
+each of them the same way whether it reads the module lazily or whole.
+
+Usage: lazy_corrupt.py <loop-features-driver> <work dir>
+"""
+
+import os
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+
+# The bitcode cache is the only way the driver writes bitcode.
+corpus.write_module("corpus/m.ll", [("f%d" % i, 10 + i, 1 + i % 3)
+                                    for i in range(8)])
+subprocess.run([driver, "-bc-cache", "cache", "-params", "out=warmup.csv",
+                "corpus"], check=True)
+entry = os.path.join("cache", os.listdir("cache")[0])
+with open(entry, "rb") as f:
+    data = f.read()
+
+
+def exit_code(path, lazy):
+    return subprocess.run([driver, "-lazy-bitcode=%s" % lazy, "-params",
+                           "out=f.csv;log-level=quiet", path],
+                          stderr=subprocess.DEVNULL).returncode
+
+
+# Overwrite a few bytes at offsets spread over the function blocks, which
+# follow the module-level records.
+mismatches = []
+num_failing = 0
+for i in range(20):
+    offset = len(data) // 3 + i * (len(data) * 2 // 3) // 20
+    corrupt = bytearray(data)
+    corrupt[offset:offset + 4] = b"\xff\xff\xff\xff"
+    path = "corrupt%d.bc" % i
+    with open(path, "wb") as f:
+        f.write(corrupt)
+    lazy, whole = exit_code(path, "true"), exit_code(path, "false")
+    if whole:
+        num_failing += 1
+    if (lazy == 0) != (whole == 0):
+        mismatches.append((offset, lazy, whole))
+assert num_failing, "no corruption was detected at all"
+assert not mismatches, mismatches
+print("ok: %d of 20 corrupt modules rejected" % num_failing)
@@ -0,0 +1,61 @@
+"""Checks what the ModuleHash tells apart: modules that only differ in a
+loop bound, a cmp predicate, a global initializer or the size of a
+zero-initialized global get different hashes, and a module read lazily from
+bitcode hashes the same as its text.
+
+Usage: module_hash.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import os
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+
+GLOBAL = "@sizes = global [2 x i32] [i32 %d, i32 4]\n"
+ZEROS = "@data = global [%d x double] zeroinitializer\n"
+
+
+def module_hash(text, *args):
+    """Writes text to the same path every time and returns the hashes of
+    the rows the driver writes for it."""
+    os.makedirs("corpus", exist_ok=True)
+    with open("corpus/m.ll", "w") as f:
+        f.write(text)
+    if os.path.exists("f.csv"):
+        os.remove("f.csv")
+    subprocess.run([driver, "-params", "out=f.csv", *args, "corpus/m.ll"],
+                   check=True)
+    with open("f.csv") as f:
+        hashes = {row["ModuleHash"] for row in csv.DictReader(f)}
+    assert len(hashes) == 1, hashes
+    return hashes.pop()
+
+
+base = corpus.loop_function("kernel", 100, 2)
+hashes = {
+    module_hash(base),
+    # A PolyBench dataset size: only the bound differs.
+    module_hash(corpus.loop_function("kernel", 2000, 2)),
+    module_hash(base.replace("icmp slt", "icmp sle")),
+    module_hash(GLOBAL % 1 + base),
+    module_hash(GLOBAL % 2 + base),
+    # Zero-initialized arrays only differ in their type.
+    module_hash(ZEROS % 1000 + base),
+    module_hash(ZEROS % 2000 + base),
+}
+assert len(hashes) == 7, hashes
+assert module_hash(base) == module_hash(base), "hash is not deterministic"
+
+# The bitcode cache gives the same module as bitcode, read lazily by default.
+text_hash = module_hash(GLOBAL % 3 + base, "-bc-cache", "cache")
+entries = os.listdir("cache")
+assert len(entries) == 1, entries
+for lazy in ["-lazy-bitcode=true", "-lazy-bitcode=false"]:
+    subprocess.run([driver, lazy, "-params", "out=bc%s.csv" % lazy[-4:],
+                    "cache/" + entries[0]], check=True)
+    with open("bc%s.csv" % lazy[-4:]) as f:
+        assert {row["ModuleHash"] for row in csv.DictReader(f)} == {text_hash}
+print("ok")
@@ -0,0 +1,56 @@
+"""Runs many driver processes that append to one .npy matrix at the same
+time and checks that row i of the matrix still belongs to row i of its
+index file.
+
+Usage: npy_concurrent.py <loop-features-driver> <work dir>
+"""
+
+import csv
+import struct
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+
+# Module i has one function f<bound> with a single loop of trip count bound,
+# so every row names the value its trip_count column must hold.
+# Each process commits many modules, so their commits interleave.
+NUM_PROCS = 12
+MODULES_PER_PROC = 40
+NUM_MODULES = NUM_PROCS * MODULES_PER_PROC
+for i in range(NUM_MODULES):
+    bound = 10 + i
+    corpus.write_module("corpus/p%d/m%d.ll" % (i % NUM_PROCS, i),
+                        [("f%d" % bound, bound, 1)])
+
+# The numeric columns of the matrix are the CSV columns after the key.
+subprocess.run([driver, "-params", "out=columns.csv", "corpus/p0/m0.ll"],
+               check=True)
+with open("columns.csv") as f:
+    columns = next(csv.reader(f))[4:]
+trip_count = columns.index("trip_count")
+
+procs = [subprocess.Popen([driver, "-j", "1", "-params",
+                           "out=f.npy;format=npy", "corpus/p%d" % p])
+         for p in range(NUM_PROCS)]
+assert all(p.wait() == 0 for p in procs)
+
+with open("f.npy", "rb") as f:
+    data = f.read()
+header = data[:128].decode("latin1")
+matrix = data[128:]
+row_size = 4 * len(columns)
+assert len(matrix) == NUM_MODULES * row_size, (len(matrix), header)
+assert "'shape': (%d, %d)" % (NUM_MODULES, len(columns)) in header, header
+
+with open("f.index.csv") as f:
+    index = list(csv.reader(f))[1:]
+assert len(index) == NUM_MODULES, len(index)
+mismatches = 0
+for i, key in enumerate(index):
+    value = struct.unpack_from("<i", matrix, i * row_size + 4 * trip_count)[0]
+    if "f%d" % value != key[2]:
+        mismatches += 1
+assert mismatches == 0, "%d matrix rows do not match their index row" % mismatches
+print("ok: %d rows" % NUM_MODULES)
@@ -0,0 +1,58 @@
+"""Appends rows with other columns to existing outputs and checks that the
+outputs are left as they were and the driver fails. An npy index with other
+key columns leaves its matrix alone too.
+
+Usage: schema_mismatch.py <loop-features-driver> <work dir>
+"""
+
+import subprocess
+
+import corpus
+
+driver = corpus.start_test()
+corpus.write_module("corpus/a.ll", [("f", 10, 2)])
+
+
+def run(params, expect_rc=0):
+    proc = subprocess.run([driver, "-params", params, "corpus"],
+                          stderr=subprocess.PIPE, text=True)
+    assert proc.returncode == expect_rc, (params, proc.returncode, proc.stderr)
+    return proc.stderr
+
+
+for ext, fmt in [("csv", "csv"), ("lfb", "binary"), ("arrow", "arrow"),
+                 ("npy", "npy")]:
+    path = "f." + ext
+    run("out=%s;format=%s;features=basic" % (path, fmt))
+    # The same columns append.
+    run("out=%s;format=%s;features=basic" % (path, fmt))
+    with open(path, "rb") as f:
+        before = f.read()
+    err = run("out=%s;format=%s" % (path, fmt), expect_rc=1)
+    assert "not appending" in err, (fmt, err)
+    with open(path, "rb") as f:
+        assert f.read() == before, "%s was changed" % path
+
+# The matrix takes no rows its index rejected.
+run("out=g.npy;format=npy")
+with open("g.index.csv") as f:
+    index = f.read()
+with open("g.index.csv", "w") as f:
+    f.write(index.replace("ModuleHash,", "", 1))
+with open("g.npy", "rb") as f:
+    before = f.read()
+err = run("out=g.npy;format=npy", expect_rc=1)
+assert "g.index.csv was written with other columns" in err, err
+with open("g.npy", "rb") as f:
+    assert f.read() == before, "g.npy was changed"
+with open("g.index.csv") as f:
+    assert len(f.readlines()) == 1 + 2
+
+# An output that cannot be opened fails the run as well.
+err = run("out=missing/f.csv", expect_rc=1)
+assert "Could not open missing/f.csv" in err, err
+
+# Both runs with the same columns went to the file.
+with open("f.csv") as f:
+    assert len(f.readlines()) == 1 + 2 * 2
+print("ok")